@@ -4,20 +4,56 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
 #include "hardware/adc.h"
 #include "hardware/uart.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/structs/systick.h"
 #include "pico/bootrom.h"
+#include "pico/multicore.h"
 #include "ws2812.pio.h"
+#include "selector.pio.h"
 
 #include "tusb.h"
 #include "usb_descriptors.h"
 
 // configuration {{{1
 
-// analog values go from 0 to 9. The change needed to detect a key press
-#define SENSITIVITY 6
+// key values (travel) go from 0 to TRAVEL_MAX
+#define TRAVEL_MAX 255
+// converts a value in the 0 to 9 scale to travel
+#define TRAVEL(v) ((v) * TRAVEL_MAX / 9)
+// change in an analog value needed to send it, in tenths of a travel step,
+//   until the noise of the key is measured; then it is NOISE_SIGMAS times
+//   the noise of the key at rest, at least TRAVEL_HYSTERESIS_MIN; values
+//   below it are sent as 0
+#define TRAVEL_HYSTERESIS 20
+#define TRAVEL_HYSTERESIS_MIN 5
+#define NOISE_SIGMAS 3
+// default values where a key is pressed and released
+//   (each key has its own in keyTrigger)
+#define ACTUATION_VAL TRAVEL(6)
+#define RELEASE_VAL TRAVEL(3)
+// rapid trigger: a change in the direction of travel, at any point, presses
+//   or releases the key; a key is pressed only at RAPID_TRIGGER_MIN_VAL or
+//   deeper, and is always released above it
+#define RAPID_TRIGGER_SENSITIVITY TRAVEL(2)
+#define RAPID_TRIGGER_MIN_VAL TRAVEL(2)
+// keys that always use rapid trigger, one bit per key id (layers are in layerRapidTrigger)
+#define RAPID_TRIGGER_KEYS 0ull
+// early press: a key is pressed before reaching its actuation point when it
+//   rises at least EARLY_PRESS_VELOCITY (tenths of travel steps per frame) for
+//   EARLY_PRESS_FRAMES frames, and has risen at least EARLY_PRESS_MIN_RISE
+//   (travel); it is released if it falls back EARLY_PRESS_MIN_RISE before
+//   reaching actuation (false trigger)
+#define EARLY_PRESS true
+#define EARLY_PRESS_VELOCITY (TRAVEL_MAX * 10 / 100)
+#define EARLY_PRESS_FRAMES 3
+#define EARLY_PRESS_MIN_RISE TRAVEL(1)
 // time between mouse events when a key is pressed
 #define MOUSE_PERIOD_MS 30u
 // time between pressing a key and it being considered held (not tapped)
@@ -26,14 +62,72 @@
 #define LOCK_DELAY_MS 200u
 // ignore changes in digital key during this time to debounce it
 #define DEBOUNCING_DELAY_MS 20u
+// eager: a change is reported at once, then changes are ignored for DEBOUNCING_DELAY_MS
+// deferred: a change is reported after being stable for DEBOUNCING_DELAY_MS
+#define DEBOUNCE_EAGER true
 // period to send kb status to other side
 #define COMM_STATUS_DELAY_MS 20u
-
+// time to wait after turning a selector line off, before turning the next one on
+#define SEL_SETTLE_DELAY_US 50u
+// without key movement for this time, scan analog keys at a lower rate; a
+//   first press waits up to 1/IDLE_SCAN_HZ (2ms) for a scan, below the 5ms
+//   USB poll interval, while the scanner works about a quarter of the time of
+//   full rate (digital keys are woken by pin edges instead)
+#define IDLE_DELAY_MS 10000u
+#define IDLE_SCAN_HZ 500u
+// change in an analog raw value (from its filtered value) considered key movement
+#define MOVEMENT_RAW_DELTA 16
+// number of ADC conversions averaged into each analog raw value; frames paced
+//   while idle only convert each input once, and the ADC is powered down
+//   between them
+#define ADC_OVERSAMPLING 4
+#define IDLE_ADC_OVERSAMPLING 1
+// weight of the exponential filter of analog raw values (new value weights 1/2^weight)
+//   less noise from oversampling allows a lower weight, with less lag
+#define RAW_FILTER_WEIGHT 2
+// learned limits of analog keys are saved to flash at most this often, if changed
+#define CAL_SAVE_INTERVAL_MS (10 * 60 * 1000u)
+// change in a limit (raw) needed to save the limits again
+#define CAL_SAVE_MIN_CHANGE 8
+// a restored limit is used only if the first reading of the key is this close to it (raw)
+#define CAL_RESTORE_TOLERANCE 40
+// frames between readings of the temperature sensor
+#define TEMP_FRAMES 256
+// duration of crosstalk calibration (XTALK_CAL command)
+#define CROSSTALK_CAL_MS 30000u
+// duration of the sweep that builds the linearization tables (LUT_CAL command)
+#define LUT_CAL_MS 30000u
+// key health: a key pressed more than HEALTH_MAX_PRESSES times in
+//   HEALTH_WINDOW_MS is quarantined (ignored); an analog key is also
+//   quarantined if its raw value stays at an ADC rail for HEALTH_STUCK_MS,
+//   or within 1 of a value for HEALTH_STUCK_MS with no noise measured at rest
+//   (noise variance below HEALTH_STUCK_NOISE_S, about what the noise filter
+//   decays to with no deviation at all), or if its raw range collapses
+#define HEALTH_MAX_PRESSES 25
+#define HEALTH_WINDOW_MS 1000u
+#define HEALTH_STUCK_MS 60000u
+#define HEALTH_STUCK_NOISE_S 64
+#define HEALTH_RAIL_RAW 8
+
+// initial baud rate of the link between halves; the left half then steps up
+//   to the fastest rate that passes a test, and falls back if errors climb
 #define BAUD_RATE 500000
+// more bad frames than this in a second make the link go one rate down
+#define LINK_MAX_ERRORS 4
+// key changes are handled in the order they happened (by their scan time);
+//   while a key of the other half is off its rest position, a change of this
+//   half waits for earlier changes of the other half that may still be on the
+//   link, as long as the link latency (see comm_linkLatency_µs), at most
+//   EVENT_ORDER_DELAY_US (also the wait before the latency is measured)
+#define EVENT_ORDER_DELAY_US 2000u
+
+// scan keys on core1; core0 does comm, controller and usb
+#define SCAN_ON_CORE1 true
 
 #define N_SEL_PINS 5
 #define N_ANA_PINS 4
 #define N_ANALOG_HWKKEYS (N_SEL_PINS * N_ANA_PINS)
+#define N_LINE_SAMPLES (N_ANA_PINS * ADC_OVERSAMPLING)
 #define N_DIGITAL_HWKKEYS 32
 #define N_KEYS 36
 
@@ -140,6 +234,7 @@ typedef enum {
   NUM,
   FUN,
   NUM2,
+  GAME,
   NO_LAYER,
 } layer_id_t;
 
@@ -268,11 +363,13 @@ void usb_releaseKeycode(USB *self, keycode_t keycode);
 void usb_pressMouseButton(USB *self, button_t button);
 void usb_releaseMouseButton(USB *self, button_t button);
 void usb_moveMouse(USB *self, int8_t v, int8_t h, int8_t wv, int8_t wh);
+void usb_setGamepad(USB *self, hid_gamepad_report_t *report);
 
 void controller_init(Controller *self, USB *usb);
 void controller_task(Controller *self);
 void controller_changeBaseLayer(Controller *self, layer_id_t layer);
 layer_id_t controller_baseLayer(Controller *self);
+layer_id_t controller_currentLayer(Controller *self);
 void controller_pressKeycode(Controller *self, keycode_t keycode);
 void controller_releaseKeycode(Controller *self, keycode_t keycode);
 void controller_pressString(Controller *self, char s[]);
@@ -285,6 +382,8 @@ void controller_lockLayer(Controller *self, layer_id_t layer);
 void controller_pressMouseButton(Controller *self, button_t button);
 void controller_releaseMouseButton(Controller *self, button_t button);
 void controller_moveMouse(Controller *self, int v, int h, int wv, int wh);
+void controller_moveGamepadAxis(Controller *self, int axis, int amount);
+void controller_pressGamepadButton(Controller *self, uint8_t button);
 void controller_setDelayedReleaseAction(Controller *self, Action action);
 void controller_doCommand(Controller *self, int command);
 void controller_keyPressed(Controller *self, Key *key);
@@ -295,14 +394,25 @@ Key *Key_keyWithId(uint8_t keyId);
 void key_init(Key *self, Controller *controller, uint8_t keyId);
 int8_t key_id(Key *self);
 keyboardSide key_side(Key *self);
-void key_setNewAnalogRaw(Key *self, uint16_t newRaw);
-void key_setVal(Key *self, uint8_t newVal);
-int8_t key_val(Key *self);
+void key_setVal(Key *self, uint8_t newVal, uint32_t time_µs);
+void key_setRapidTrigger(Key *self, bool rapidTrigger);
+void key_earlyPress(Key *self);
+bool key_setTriggerPoints(Key *self, int actuation, int release);
+bool key_isQuarantined(Key *self);
+void key_setQuarantined(Key *self, bool quarantined);
+uint8_t key_val(Key *self);
+bool key_isPressed(Key *self);
+void key_resendVal(Key *self);
 void key_processChanges(Key *self);
 void key_setReleaseAction(Key *self, Action action);
 Action *key_releaseAction(Key *self);
 char *key_description(Key *self);
-void key_setMinRawRange(Key *self, uint16_t range);
+
+void analogScan_requestCalibration(void);
+void calStore_requestSave(void);
+void analogKeys_requestCrosstalkCalibration(void);
+void analogKeys_requestLutCalibration(void);
+uint16_t analogKeys_noise10(int slot);
 
 enum holdType { noHoldType, modHoldType, layerHoldType };
 Action Action_noAction(void);
@@ -310,6 +420,7 @@ char *action_description(Action *a);
 void action_actuate(Action *self, Key *key, Controller *controller);
 bool action_isTypingAction(Action *self);
 bool action_isMouseMovementAction(Action *self);
+bool action_isGamepadAction(Action *self);
 Action action_holdAction(Action *self);
 Action action_tapAction(Action *self);
 enum holdType action_holdType(Action *self);
@@ -326,7 +437,7 @@ enum holdType action_holdType(Action *self);
 #define LOG_K 0b01000000
 #define LOG_L 0b10000000
 
-uint8_t log_level = LOG_L | LOG_R | LOG_C;
+uint8_t log_level = LOG_L | LOG_R | LOG_C | LOG_E;
 
 void log_set_level(uint8_t new_level)
 {
@@ -364,6 +475,8 @@ typedef enum {
   mouse_move_action,
   mouse_button_action,
   command_action,
+  gamepad_axis_action,
+  gamepad_button_action,
 
   rel_key_action,
   rel_asc_action,
@@ -394,6 +507,8 @@ char *action_name[] = {
   [mouse_move_action]     = "mouse_move",
   [mouse_button_action]   = "mouse_button",
   [command_action]        = "command",
+  [gamepad_axis_action]   = "gamepad_axis",
+  [gamepad_button_action] = "gamepad_button",
   // release actions
   [rel_key_action]        = "rel_key",
   [rel_asc_action]        = "rel_asc",
@@ -459,7 +574,24 @@ typedef struct {
   button_t button;
 } mouse_button_action_t;
 typedef struct {
-  enum { RESET, WORDLOCK, USB_SIDE } command;
+  enum {
+    gp_left,
+    gp_right,
+    gp_up,
+    gp_down,
+    gp_rleft,
+    gp_rright,
+    gp_rup,
+    gp_rdown,
+    gp_z,
+    gp_rz,
+  } axis;
+} gamepad_axis_action_t;
+typedef struct {
+  uint8_t button;
+} gamepad_button_action_t;
+typedef struct {
+  enum { RESET, WORDLOCK, USB_SIDE, SETTLE_CAL, SAVE_CAL, RAPID_TRIG, XTALK_CAL, LUT_CAL } command;
 } command_action_t;
 
 struct action {
@@ -479,6 +611,8 @@ struct action {
     mouse_move_action_t mouse_move;
     mouse_button_action_t mouse_button;
     command_action_t command;
+    gamepad_axis_action_t gamepad_axis;
+    gamepad_button_action_t gamepad_button;
   };
 };
 
@@ -519,6 +653,10 @@ struct action {
 #define MOU(m)     (Action){ mouse_move_action,   .mouse_move = { m } }
 // send a mouse button press
 #define BUT(b)     (Action){ mouse_button_action, .mouse_button = { b } }
+// move a gamepad axis proportionally to key travel
+#define GAX(a)     (Action){ gamepad_axis_action, .gamepad_axis = { a } }
+// press a gamepad button (0-31) while key is pressed
+#define GBT(b)     (Action){ gamepad_button_action, .gamepad_button = { b } }
 // auxiliary actions, associated to the release of a key
 // release a keycode
 #define REK(k)     (Action){ rel_key_action,      .key = k }
@@ -585,17 +723,26 @@ void mouse_move_actuate(Action *self, Key *key, Controller *controller) {
   int val = key_val(key);
   if (val == 0) return;
   int h = 0, v = 0, wh = 0, wv = 0;
-  int move[] = { 0, 85, 170, 260, 360, 480, 640, 880, 1280, 2000 };
-  int wheel[] = { 0, 11, 22, 34, 48, 66, 92, 134, 208, 346 };
+  // speeds at travel 0 to 9, interpolated for intermediate values
+  static const int move[] = { 0, 85, 170, 260, 360, 480, 640, 880, 1280, 2000 };
+  static const int wheel[] = { 0, 11, 22, 34, 48, 66, 92, 134, 208, 346 };
+  int pos = val * 9;
+  int i = pos / TRAVEL_MAX;
+  int frac = pos % TRAVEL_MAX;
+  int mv = move[i], wl = wheel[i];
+  if (frac != 0) {
+    mv += (move[i + 1] - move[i]) * frac / TRAVEL_MAX;
+    wl += (wheel[i + 1] - wheel[i]) * frac / TRAVEL_MAX;
+  }
   switch (self->mouse_move.move) {
-    case mv_up   : v  = -move[val]; break;
-    case mv_down : v  = +move[val]; break;
-    case mv_right: h  = +move[val]; break;
-    case mv_left : h  = -move[val]; break;
-    case wh_up   : wv = +wheel[val]; break;
-    case wh_down : wv = -wheel[val]; break;
-    case wh_right: wh = +wheel[val]; break;
-    case wh_left : wh = -wheel[val]; break;
+    case mv_up   : v  = -mv; break;
+    case mv_down : v  = +mv; break;
+    case mv_right: h  = +mv; break;
+    case mv_left : h  = -mv; break;
+    case wh_up   : wv = +wl; break;
+    case wh_down : wv = -wl; break;
+    case wh_right: wh = +wl; break;
+    case wh_left : wh = -wl; break;
   }
   controller_moveMouse(controller, v, h, wv, wh);
 }
@@ -607,6 +754,17 @@ void command_actuate(Action *self, Key *key, Controller *controller) {
   controller_doCommand(controller, self->command.command);
   key_setReleaseAction(key, NO_ACTION);
 }
+// gamepad
+void gamepad_axis_actuate(Action *self, Key *key, Controller *controller) {
+  int val = key_val(key);
+  if (val == 0) return;
+  controller_moveGamepadAxis(controller, self->gamepad_axis.axis, val * 127 / TRAVEL_MAX);
+}
+void gamepad_button_actuate(Action *self, Key *key, Controller *controller) {
+  if (key_isPressed(key)) {
+    controller_pressGamepadButton(controller, self->gamepad_button.button);
+  }
+}
 
 // actuate on key release
 void rel_key_actuate(Action *self, Key *key, Controller *controller) {
@@ -654,6 +812,8 @@ void action_actuate(Action *self, Key *key, Controller *controller)
     ACTION_CASE(mouse_move);
     ACTION_CASE(mouse_button);
     ACTION_CASE(command);
+    ACTION_CASE(gamepad_axis);
+    ACTION_CASE(gamepad_button);
     ACTION_CASE(rel_key);
     ACTION_CASE(rel_asc);
     ACTION_CASE(rel_mod);
@@ -696,6 +856,12 @@ bool action_isMouseMovementAction(Action *self)
   return self->action_type == mouse_move_action;
 }
 
+bool action_isGamepadAction(Action *self)
+{
+  return self->action_type == gamepad_axis_action
+      || self->action_type == gamepad_button_action;
+}
+
 Action action_tapAction(Action *self)
 {
   switch (self->action_type) {
@@ -776,10 +942,10 @@ Action layer[][N_KEYS] = {
     KOL(K_ENT,NUM2), KOL(K_BS,SYM  ), KOL(K_DEL,FUN ),
   },
   [RAT] = {
-    COM(RESET     ), NO_ACTION,       BAS(QWERTY    ), BAS(COLEMAK   ), NO_ACTION,
-    MOD(GUI       ), MOD(ALT       ), MOD(CTRL      ), MOD(SHFT      ), NO_ACTION,
-    NO_ACTION,       MOD(RALT      ), LCK(FUN       ), LCK(RAT       ), NO_ACTION,
-    NO_ACTION,       NO_ACTION,       NO_ACTION,
+    COM(RESET     ), COM(SETTLE_CAL), BAS(QWERTY    ), BAS(COLEMAK   ), COM(SAVE_CAL  ),
+    MOD(GUI       ), MOD(ALT       ), MOD(CTRL      ), MOD(SHFT      ), COM(XTALK_CAL ),
+    COM(RAPID_TRIG), MOD(RALT      ), LCK(FUN       ), LCK(RAT       ), LCK(GAME      ),
+    COM(LUT_CAL   ), NO_ACTION,       NO_ACTION,
     KEY(K_VOLUP   ), MOU(wh_left   ), MOU(mv_up     ), MOU(wh_right  ), MOU(wh_up     ),
     KEY(K_VOLDOWN ), MOU(mv_left   ), MOU(mv_down   ), MOU(mv_right  ), MOU(wh_down   ),
     KEY(K_MUTE    ), NO_ACTION,       NO_ACTION,       NO_ACTION,       NO_ACTION,
@@ -835,8 +1001,22 @@ Action layer[][N_KEYS] = {
     NO_ACTION,       LCK(NUM2      ), LCK(NUM       ), MOD(RALT      ), NO_ACTION,
     NO_ACTION,       NO_ACTION,       NO_ACTION,
   },
+  [GAME] = {
+    GBT(4         ), GAX(gp_up     ), GBT(5         ), GAX(gp_z      ), GBT(8         ),
+    GAX(gp_left   ), GAX(gp_down   ), GAX(gp_right  ), GBT(0         ), GBT(9         ),
+    GBT(6         ), GBT(7         ), GBT(10        ), GBT(11        ), LCK(GAME      ),
+    GBT(12        ), GBT(1         ), GBT(2         ),
+    GBT(13        ), GAX(gp_rz     ), GAX(gp_rup    ), GBT(14        ), GBT(15        ),
+    GBT(3         ), GAX(gp_rleft  ), GAX(gp_rdown  ), GAX(gp_rright ), GBT(16        ),
+    GBT(17        ), GBT(18        ), GBT(19        ), GBT(20        ), GBT(21        ),
+    GBT(22        ), GBT(23        ), GBT(24        ),
+  },
 };
 
+// layers where all keys use rapid trigger (see also key_setRapidTrigger);
+//   none by default, toggled for the base layer by COM(RAPID_TRIG)
+bool layerRapidTrigger[NO_LAYER];
+
 bool layer_hasMouseMovementAction(layer_id_t layer_num)
 {
   for (int k = 0; k < N_KEYS; k++) {
@@ -845,6 +1025,14 @@ bool layer_hasMouseMovementAction(layer_id_t layer_num)
   return false;
 }
 
+bool layer_hasGamepadAction(layer_id_t layer_num)
+{
+  for (int k = 0; k < N_KEYS; k++) {
+    if (action_isGamepadAction(&layer[layer_num][k])) return true;
+  }
+  return false;
+}
+
 // WS2812 rgb led {{{1
 
 #define WS2812_PIN 16
@@ -995,6 +1183,49 @@ modifier_t keycodeq_removeModifier(Keycodeq *self)
   return modifier;
 }
 
+// Scanq {{{1
+// lock-free queue of key values, from the core that scans the keys to the
+// core that processes them. Single producer, single consumer: head is only
+// written by the producer, tail only by the consumer.
+
+#define SCANQ_N 64 // must be a power of 2
+typedef struct {
+  struct scanq_data {
+    uint8_t keyId;
+    uint8_t val;
+    bool early; // early press detected by the scanner
+    uint32_t time_µs; // when the value was scanned
+  } data[SCANQ_N];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+} Scanq;
+
+Scanq scanq;
+
+bool scanq_insert(Scanq *self, uint8_t keyId, uint8_t val, bool early, uint32_t time_µs)
+{
+  uint32_t head = self->head;
+  if (head - self->tail >= SCANQ_N) return false;
+  self->data[head % SCANQ_N] = (struct scanq_data){ keyId, val, early, time_µs };
+  __dmb(); // data must be visible before head
+  self->head = head + 1;
+  return true;
+}
+
+bool scanq_remove(Scanq *self, uint8_t *keyId, uint8_t *val, bool *early, uint32_t *time_µs)
+{
+  uint32_t tail = self->tail;
+  if (tail == self->head) return false;
+  __dmb(); // read data only after seeing head
+  *keyId = self->data[tail % SCANQ_N].keyId;
+  *val = self->data[tail % SCANQ_N].val;
+  *early = self->data[tail % SCANQ_N].early;
+  *time_µs = self->data[tail % SCANQ_N].time_µs;
+  __dmb(); // data must be read before freeing its place
+  self->tail = tail + 1;
+  return true;
+}
+
 
 // USB {{{1
 // interfaces with tinyUSB
@@ -1006,6 +1237,8 @@ struct usb {
   uint8_t modifiers;
   uint8_t sent_modifiers;
   button_t buttons;
+  hid_gamepad_report_t gamepad;
+  hid_gamepad_report_t sent_gamepad;
 };
 
 USB *USB_singleton;
@@ -1019,6 +1252,8 @@ void usb_init(USB *self)
   self->n_keycodes = 0;
   memset(self->keycodes, 0, 6);
   self->buttons = 0;
+  memset(&self->gamepad, 0, sizeof(self->gamepad));
+  memset(&self->sent_gamepad, 0, sizeof(self->sent_gamepad));
 
   tusb_init();
 }
@@ -1103,6 +1338,27 @@ void usb_moveMouse(USB *self, int8_t v, int8_t h, int8_t wv, int8_t wh)
   usb_sendMouseReport(self, self->buttons, v, h, wv, wh);
 }
 
+// the report is sent by usb_task, at most once per USB poll and only if changed
+void usb_setGamepad(USB *self, hid_gamepad_report_t *report)
+{
+  self->gamepad = *report;
+}
+
+static bool usb__gamepadChanged(USB *self)
+{
+  return memcmp(&self->gamepad, &self->sent_gamepad, sizeof(self->gamepad)) != 0;
+}
+
+static void usb__sendGamepadReport(USB *self)
+{
+  log(LOG_U, "usb gamepad: x%d y%d z%d rx%d ry%d rz%d B%x",
+      self->gamepad.x, self->gamepad.y, self->gamepad.z,
+      self->gamepad.rx, self->gamepad.ry, self->gamepad.rz, self->gamepad.buttons);
+  if (tud_hid_report(REPORT_ID_GAMEPAD, &self->gamepad, sizeof(self->gamepad))) {
+    self->sent_gamepad = self->gamepad;
+  }
+}
+
 void usb__removeKeycodeAt(USB *self, int8_t i)
 {
   if (self->n_keycodes < i + 1) return;
@@ -1164,7 +1420,13 @@ void usb_task(USB *self)
   tud_task();
   status.usbReady = tud_ready();
   if (!status.usbActive) return;
-  if (keycodeq_head(&self->keycodeq) == none) return;
+  if (keycodeq_head(&self->keycodeq) == none) {
+    // keyboard reports have priority
+    if (usb__gamepadChanged(self) && !tud_suspended() && tud_hid_ready()) {
+      usb__sendGamepadReport(self);
+    }
+    return;
+  }
   if (tud_suspended()) tud_remote_wakeup();
   if (!tud_hid_ready()) return;
   switch (keycodeq_head(&self->keycodeq)) {
@@ -1194,9 +1456,87 @@ void usb_task(USB *self)
 #define UART1_RX_PIN 5
 
 static uart_inst_t *comm_uart_id = NULL;
-static int comm_error_count = 0, comm_received_message_count = 0;
+static int comm_error_count = 0, comm_received_frame_count = 0;
+// frames with a bad length or crc (for the link quality; bytes skipped while
+//   looking for a frame are not counted)
+static int comm_bad_frame_count = 0;
 static Timer send_timer, recv_timer;
 
+// ring buffers between the UART interrupt and the main loop, so that sending
+// never waits for the UART and received bytes are kept while the main loop is
+// busy. Single producer, single consumer: head is only written by the
+// producer, tail only by the consumer.
+#define COMM_RING_N 256 // must be a power of 2
+typedef struct {
+  uint8_t data[COMM_RING_N];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  uint32_t highWater; // maximum number of bytes in the buffer
+  uint32_t overflows; // bytes (rx) or frames (tx) dropped for lack of space
+} CommRing;
+
+static CommRing comm_tx, comm_rx;
+
+static inline uint32_t commRing_count(CommRing *self)
+{
+  return self->head - self->tail;
+}
+
+// caller must check that there is space
+static inline void commRing_put(CommRing *self, uint8_t c)
+{
+  uint32_t head = self->head;
+  self->data[head % COMM_RING_N] = c;
+  __dmb(); // data must be visible before head
+  self->head = head + 1;
+  uint32_t count = head + 1 - self->tail;
+  if (count > self->highWater) self->highWater = count;
+}
+
+// caller must check that the buffer is not empty
+static inline uint8_t commRing_get(CommRing *self)
+{
+  uint32_t tail = self->tail;
+  __dmb(); // read data only after seeing head
+  uint8_t c = self->data[tail % COMM_RING_N];
+  __dmb(); // data must be read before freeing its place
+  self->tail = tail + 1;
+  return c;
+}
+
+// moves bytes from the tx buffer to the UART FIFO while there is space
+static void comm__fillTxFifo()
+{
+  while (commRing_count(&comm_tx) > 0 && uart_is_writable(comm_uart_id)) {
+    uart_get_hw(comm_uart_id)->dr = commRing_get(&comm_tx);
+  }
+  if (commRing_count(&comm_tx) == 0) {
+    // nothing more to send; the next frame restarts transmission
+    uart_get_hw(comm_uart_id)->icr = UART_UARTICR_TXIC_BITS;
+  }
+}
+
+static void comm__uartIrq()
+{
+  while (uart_is_readable(comm_uart_id)) {
+    uint8_t c = uart_getc(comm_uart_id);
+    if (commRing_count(&comm_rx) < COMM_RING_N) {
+      commRing_put(&comm_rx, c);
+    } else {
+      comm_rx.overflows++;
+    }
+  }
+  comm__fillTxFifo();
+}
+
+// starts sending the bytes in the tx buffer, the interrupt sends the rest
+static void comm__startTx()
+{
+  uint32_t save = save_and_disable_interrupts();
+  comm__fillTxFifo();
+  restore_interrupts(save);
+}
+
 void comm_init(int id)
 {
   uint tx_pin, rx_pin;
@@ -1213,67 +1553,283 @@ void comm_init(int id)
   uart_set_fifo_enabled(comm_uart_id, true);
   gpio_set_function(tx_pin, GPIO_FUNC_UART);
   gpio_set_function(rx_pin, GPIO_FUNC_UART);
+  int irq = (id == 0) ? UART0_IRQ : UART1_IRQ;
+  irq_set_exclusive_handler(irq, comm__uartIrq);
+  irq_set_enabled(irq, true);
+  uart_set_irq_enables(comm_uart_id, true, true);
+}
+
+bool comm_readable()
+{
+  return commRing_count(&comm_rx) > 0;
 }
 
 uint8_t comm_getc()
 {
-  return uart_getc(comm_uart_id);
+  return commRing_get(&comm_rx);
 }
 
+// caller must check that there is space (see comm_sendFrame)
 void comm_putc(uint8_t c)
 {
-  uart_putc_raw(comm_uart_id, c);
+  commRing_put(&comm_tx, c);
+}
+
+// high-water marks and overflows of the buffers
+void comm_bufferStats(uint32_t *txHigh, uint32_t *txOver, uint32_t *rxHigh, uint32_t *rxOver)
+{
+  *txHigh = comm_tx.highWater;
+  *txOver = comm_tx.overflows;
+  *rxHigh = comm_rx.highWater;
+  *rxOver = comm_rx.overflows;
+}
+
+// a frame is COMM_SYNC, payload length, payload and CRC-16 (of length and
+//   payload, big endian); the payload is a sequence of records, each with a
+//   type, a data length and data, so receivers skip types they do not know
+#define COMM_SYNC 0xa5
+#define COMM_MAX_PAYLOAD 64
+#define COMM_MAX_FRAME (COMM_MAX_PAYLOAD + 4)
+enum {
+  COMM_REC_KEYS = 1,   // sequence number and send time (32 bits each, little
+                       //   endian), then per key: id
+                       //   (+0x80 if early press), value and µs from scan
+                       //   to send time (16 bits)
+  COMM_REC_STATUS = 2, // status bits, see comm_sendStatus
+  COMM_REC_LINK = 3,   // baud rate negotiation, see comm__receiveLink
+  COMM_REC_CLOCK = 4,  // clock synchronization, see comm__receiveClock
+  COMM_REC_ACK = 5,    // sequence numbers of keys records received (32 bits)
+};
+
+static uint8_t comm_frame[COMM_MAX_FRAME];
+static uint8_t comm_frame_len = 0;  // payload bytes in comm_frame
+static int comm_keys_record = -1;   // payload index of open keys record
+// while the link switches rate (see comm__setRate), frames are held in
+//   comm_frame until the bytes queued at the old rate are sent
+static int comm_switchRate = -1;    // rate to switch to, -1 if none
+
+// keys records are numbered and kept until acknowledged; one that is not
+// acknowledged in COMM_RETX_MS is sent again, up to COMM_MAX_RETRIES times.
+// The receiver applies a key value only if it comes in a record newer than
+// the one of the last value applied to that key, so records can arrive
+// repeated or out of order.
+// A value sent in a new record is removed from the older records kept, so
+// each kept record has a key of this half that no other has, and a slot per
+// key is enough however fast keys change.
+#define COMM_RETX_N (N_KEYS / 2) // unacknowledged records kept
+#define COMM_RETX_MS 5u
+#define COMM_MAX_RETRIES 8
+#define COMM_KEYS_HEADER 8 // sequence number and send time
+static struct {
+  bool pending;
+  uint8_t retries;
+  uint8_t len;
+  Timer timer;
+  uint8_t data[COMM_MAX_PAYLOAD - 2];
+} comm_retx[COMM_RETX_N];
+static uint32_t comm_tx_seq = 0;
+static uint32_t comm_retransmitted_count = 0, comm_dropped_count = 0;
+// sequence number of the record of the last value applied to each key
+static uint32_t comm_keySeq[N_KEYS];
+static bool comm_keySeqValid[N_KEYS];
+// sequence numbers to acknowledge, as many as fit in a record
+#define COMM_MAX_ACKS ((COMM_MAX_PAYLOAD - 2) / 4)
+static uint32_t comm_acks[COMM_MAX_ACKS];
+static uint8_t comm_n_acks = 0;
+
+static void comm__put32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t comm__get32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// CRC-16/CCITT (polynomial 0x1021, initial value 0xffff)
+static uint16_t comm__crc16(const uint8_t *data, int n)
+{
+  uint16_t crc = 0xffff;
+  while (n-- > 0) {
+    crc ^= *data++ << 8;
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// stops retransmitting a record; its keys will be sent with their current
+//   values
+static void comm__forgetRecord(int slot)
+{
+  comm_retx[slot].pending = false;
+  for (int i = COMM_KEYS_HEADER; i + 3 < comm_retx[slot].len; i += 4) {
+    Key *key = Key_keyWithId(comm_retx[slot].data[i] & 0x7f);
+    if (key != NULL) key_resendVal(key);
+  }
+}
+
+// forgets a record that was retransmitted too many times
+static void comm__dropRecord(int slot)
+{
+  comm_dropped_count++;
+  log(LOG_C, "Err comm9 keys record %u dropped: %u",
+      comm__get32(comm_retx[slot].data), comm_dropped_count);
+  comm__forgetRecord(slot);
+}
+
+// removes the value of a key from the records kept, as a newer one is sent
+static void comm__supersede(uint8_t keyId)
+{
+  for (int slot = 0; slot < COMM_RETX_N; slot++) {
+    if (!comm_retx[slot].pending) continue;
+    uint8_t *data = comm_retx[slot].data;
+    for (int i = COMM_KEYS_HEADER; i + 3 < comm_retx[slot].len; i += 4) {
+      if ((data[i] & 0x7f) != keyId) continue;
+      comm_retx[slot].len -= 4;
+      memmove(&data[i], &data[i + 4], comm_retx[slot].len - i);
+      break;
+    }
+    if (comm_retx[slot].len == COMM_KEYS_HEADER) comm_retx[slot].pending = false;
+  }
+}
+
+// keeps a copy of the open keys record, for retransmission
+static void comm__closeKeysRecord()
+{
+  if (comm_keys_record == -1) return;
+  uint8_t *rec = &comm_frame[2 + comm_keys_record];
+  for (int i = 2 + COMM_KEYS_HEADER; i + 3 < 2 + rec[1]; i += 4) {
+    comm__supersede(rec[i] & 0x7f);
+  }
+  int slot = 0;
+  while (slot < COMM_RETX_N && comm_retx[slot].pending) slot++;
+  comm_keys_record = -1;
+  if (slot == COMM_RETX_N) return; // only with more keys than a half has
+  comm_retx[slot].pending = true;
+  comm_retx[slot].retries = 0;
+  comm_retx[slot].len = rec[1];
+  memcpy(comm_retx[slot].data, &rec[2], rec[1]);
+  timer_enable_ms(&comm_retx[slot].timer, COMM_RETX_MS);
+}
+
+// sends the frame being built, if not empty
+void comm_sendFrame()
+{
+  if (comm_frame_len == 0 || comm_switchRate != -1) return;
+  comm__closeKeysRecord();
+  comm_frame[0] = COMM_SYNC;
+  comm_frame[1] = comm_frame_len;
+  uint16_t crc = comm__crc16(&comm_frame[1], comm_frame_len + 1);
+  comm_frame[comm_frame_len + 2] = crc >> 8;
+  comm_frame[comm_frame_len + 3] = crc & 0xff;
+  if (COMM_RING_N - commRing_count(&comm_tx) < comm_frame_len + 4) {
+    // do not wait for the UART, drop the whole frame
+    comm_tx.overflows++;
+    log(LOG_C, "Err comm5 tx overflow: %u", comm_tx.overflows);
+  } else {
+    for (int i = 0; i < comm_frame_len + 4; i++) {
+      comm_putc(comm_frame[i]);
+    }
+    comm__startTx();
+  }
+  comm_frame_len = 0;
+  comm_keys_record = -1;
 }
 
-static void comm__encode_key_val(uint8_t keyId, uint8_t val, uint8_t buf[2])
+// makes room in the frame being built by sending it; while the link switches
+//   rate it cannot be sent and is dropped (its keys records are retransmitted)
+static void comm__sendFullFrame()
 {
-  uint8_t x = val * 3 + keyId;
-  uint8_t y = (x >> 3) ^ x;
-  buf[0] = ((y & 0b0111) << 4) | val;
-  buf[1] = ((y & 0b1000) << 3) | 0b10000000 | keyId;
+  if (comm_switchRate == -1) {
+    comm_sendFrame();
+    return;
+  }
+  comm__closeKeysRecord();
+  comm_tx.overflows++;
+  comm_frame_len = 0;
 }
 
-void comm_sendMessage(uint8_t keyId, uint8_t val)
+// starts a record in the frame being built, sending it first if full
+static uint8_t *comm__addRecord(uint8_t type, uint8_t n)
 {
-  uint8_t buf[2];
-  comm__encode_key_val(keyId, val, buf);
-  comm_putc(buf[0]);
-  comm_putc(buf[1]);
+  if (comm_frame_len + 2 + n > COMM_MAX_PAYLOAD) comm__sendFullFrame();
+  comm__closeKeysRecord(); // key values go to a new keys record
+  uint8_t *rec = &comm_frame[2 + comm_frame_len];
+  rec[0] = type;
+  rec[1] = n;
+  comm_frame_len += 2 + n;
+  return &rec[2];
 }
 
-bool comm_receiveMessage(uint8_t *keyIdp, uint8_t *valp)
+// receives a frame, returns its payload if complete and correct
+static bool comm__receiveFrame(uint8_t payload[COMM_MAX_PAYLOAD], uint8_t *lenp)
 {
-  static uint8_t buf[2];
+  static uint8_t buf[COMM_MAX_FRAME];
   static uint8_t count = 0;
-  while (uart_is_readable(comm_uart_id)) {
+  while (comm_readable()) {
     uint8_t c = comm_getc();
-    uint8_t keyId, val;
-    if (count == 0 && c > 127) {
+    if (count == 0 && c != COMM_SYNC) {
       comm_error_count++;
-      log(LOG_C, "Err comm0 sync: [%02hhx] %d/%d", c, comm_error_count, comm_received_message_count);
+      log(LOG_C, "Err comm0 sync: [%02hhx] %d/%d", c, comm_error_count, comm_received_frame_count);
       continue;
     }
-    buf[count++] = c;
-    if (count == 2) {
-      comm_received_message_count++;
+    if (count == 1 && (c == 0 || c > COMM_MAX_PAYLOAD)) {
+      comm_error_count++;
+      comm_bad_frame_count++;
+      log(LOG_C, "Err comm1 length: [%02hhx] %d/%d", c, comm_error_count, comm_received_frame_count);
       count = 0;
-      val   = buf[0] & 0b10001111;
-      keyId = buf[1] & 0b00111111;
-      uint8_t b[2];
-      comm__encode_key_val(keyId, val, b);
-      if (b[0] != buf[0] || b[1] != buf[1]) {
-        comm_error_count++;
-        log(LOG_C, "Err comm1 checksum: [%02hhx %02hhx] %d/%d", buf[0], buf[1], comm_error_count, comm_received_message_count);
-        continue;
-      }
-      *keyIdp = keyId;
-      *valp = val;
-      return true;
+      continue;
+    }
+    buf[count++] = c;
+    if (count < 2 || count < buf[1] + 4) continue;
+    count = 0;
+    comm_received_frame_count++;
+    uint8_t len = buf[1];
+    uint16_t crc = comm__crc16(&buf[1], len + 1);
+    if (buf[len + 2] != (crc >> 8) || buf[len + 3] != (crc & 0xff)) {
+      comm_error_count++;
+      comm_bad_frame_count++;
+      log(LOG_C, "Err comm2 crc: [%02hhx %02hhx %04hx] %d/%d", len, buf[2], crc, comm_error_count, comm_received_frame_count);
+      continue;
     }
+    memcpy(payload, &buf[2], len);
+    *lenp = len;
+    return true;
   }
   return false;
 }
 
+// adds a key value scanned at time_µs to the frame being built; all key
+//   values added before the next comm_sendFrame go in a single keys record
+void comm_addKeyVal(uint8_t keyId, uint8_t val, bool early, uint32_t time_µs)
+{
+  int needed = (comm_keys_record == -1) ? 2 + COMM_KEYS_HEADER + 4 : 4;
+  if (comm_frame_len + needed > COMM_MAX_PAYLOAD) comm__sendFullFrame();
+  if (comm_keys_record == -1) {
+    uint8_t *data = comm__addRecord(COMM_REC_KEYS, COMM_KEYS_HEADER);
+    comm__put32(&data[0], comm_tx_seq++);
+    comm__put32(&data[4], time_us_32());
+    comm_keys_record = comm_frame_len - 2 - COMM_KEYS_HEADER;
+  }
+  uint8_t *rec = &comm_frame[2 + comm_keys_record];
+  int32_t age = comm__get32(&rec[6]) - time_µs;
+  if (age < 0) age = 0;
+  if (age > 0xffff) age = 0xffff;
+  uint8_t *entry = &comm_frame[2 + comm_frame_len];
+  entry[0] = keyId | (early ? 0x80 : 0);
+  entry[1] = val;
+  entry[2] = age & 0xff;
+  entry[3] = age >> 8;
+  comm_frame_len += 4;
+  rec[1] += 4; // record data length
+}
+
 void comm_sendStatus()
 {
   uint8_t val = 0;
@@ -1281,37 +1837,442 @@ void comm_sendStatus()
   if (status.usbReady)            val |= 0b0010;
   if (status.usbActive)           val |= 0b0100;
   if (status.toggleUsb)           val |= 0b1000;
-  comm_sendMessage(62, val);
+  comm__addRecord(COMM_REC_STATUS, 1)[0] = val;
+  comm_sendFrame();
   timer_enable_ms(&send_timer, COMM_STATUS_DELAY_MS);
 }
 
+// link rate {{{2
+// the left half (master) proposes a rate, the right half acknowledges it and
+// both switch; the master then sends a test pattern at the new rate, that the
+// right half must confirm. A rate that fails is not tried again. When no frame
+// is received for LINK_LOST_MS, both halves go back to the initial rate.
+
+#define LINK_TIMEOUT_MS 50u
+#define LINK_STEP_MS 100u
+#define LINK_LOST_MS 500u
+#define LINK_QUALITY_MS 1000u
+
+static const uint32_t comm_baudRates[] = { BAUD_RATE, 1000000, 1500000, 2000000, 3000000 };
+#define N_BAUD_RATES (sizeof(comm_baudRates) / sizeof(comm_baudRates[0]))
+
+static const uint8_t comm_testPattern[] = {
+  0x00, 0xff, 0x55, 0xaa, 0x0f, 0xf0, 0x33, 0xcc,
+  0x01, 0x80, 0xfe, 0x7f, 0xa5, 0x5a, 0x96, 0x69,
+};
+
+// LINK_REPORT: the right half sends the bad frames it received in its last
+//   window, as the master only sees the errors in one direction
+enum { LINK_PROPOSE, LINK_ACK, LINK_TEST, LINK_TEST_OK, LINK_REPORT };
+
+static struct {
+  enum { linkIdle, linkProposed, linkTesting } state;
+  uint8_t rate;        // index in comm_baudRates of the rate in use
+  uint8_t prevRate;    // rate to go back to if the test fails
+  uint8_t target;      // rate proposed by the master
+  uint8_t maxRate;     // highest rate not known to fail
+  Timer timer;         // negotiation timeout or, when idle, next step up
+  Timer lostTimer;     // no frame received
+  Timer qualityTimer;  // error rate measurement window
+  int windowErrors;    // comm_bad_frame_count at start of window
+  int windowFrames;    // comm_received_frame_count at start of window
+  int errorsPerSec;    // bad frames in the last window
+  int framesPerSec;
+  int otherErrorsPerSec; // last report of the right half, at the current rate
+} comm_link;
+
+static bool comm__isLinkMaster()
+{
+  return status.mySide == leftSide;
+}
+
+// the bytes queued at the current rate must be sent first, so the switch is
+//   only requested here and done by comm__switchRateTask
+static void comm__setRate(uint8_t rate)
+{
+  comm_switchRate = rate;
+}
+
+// switches rate once the tx buffer is empty and the UART has shifted out its
+//   last byte, then sends the frame held meanwhile
+static void comm__switchRateTask()
+{
+  if (comm_switchRate == -1) return;
+  if (commRing_count(&comm_tx) > 0) return;
+  if ((uart_get_hw(comm_uart_id)->fr & UART_UARTFR_BUSY_BITS) != 0) return;
+  uint8_t rate = comm_switchRate;
+  comm_switchRate = -1;
+  comm_link.rate = rate;
+  uart_set_baudrate(comm_uart_id, comm_baudRates[rate]);
+  log(LOG_C, "comm: %u baud", comm_baudRates[rate]);
+  // errors while switching do not count
+  comm_link.windowErrors = comm_bad_frame_count;
+  comm_link.windowFrames = comm_received_frame_count;
+  comm_link.otherErrorsPerSec = 0;
+  timer_enable_ms(&comm_link.qualityTimer, LINK_QUALITY_MS);
+  timer_enable_ms(&comm_link.lostTimer, LINK_LOST_MS);
+  comm_sendFrame();
+}
+
+static void comm__sendLink(uint8_t cmd, uint8_t rate)
+{
+  bool test = cmd == LINK_TEST;
+  uint8_t *data = comm__addRecord(COMM_REC_LINK, 2 + (test ? sizeof(comm_testPattern) : 0));
+  data[0] = cmd;
+  data[1] = rate;
+  if (test) memcpy(&data[2], comm_testPattern, sizeof(comm_testPattern));
+  comm_sendFrame();
+}
+
+static void comm__linkWait(int state)
+{
+  comm_link.state = state;
+  timer_enable_ms(&comm_link.timer, state == linkIdle ? LINK_STEP_MS : LINK_TIMEOUT_MS);
+}
+
+static void comm__proposeRate(uint8_t rate)
+{
+  comm_link.target = rate;
+  comm__sendLink(LINK_PROPOSE, rate);
+  comm__linkWait(linkProposed);
+}
+
+void comm_initLink()
+{
+  memset(&comm_link, 0, sizeof(comm_link));
+  comm_link.maxRate = N_BAUD_RATES - 1;
+  comm__linkWait(linkIdle);
+  timer_enable_ms(&comm_link.qualityTimer, LINK_QUALITY_MS);
+}
+
+static void comm__receiveLink(uint8_t *data, uint8_t n)
+{
+  uint8_t cmd = data[0];
+  uint8_t rate = data[1];
+  if (rate >= N_BAUD_RATES) return;
+  bool master = comm__isLinkMaster();
+  if (cmd == LINK_PROPOSE && !master) {
+    comm__sendLink(LINK_ACK, rate);
+    comm_link.prevRate = comm_link.rate;
+    comm__setRate(rate);
+    comm__linkWait(linkTesting);
+  } else if (cmd == LINK_ACK && master) {
+    if (comm_link.state != linkProposed || rate != comm_link.target) return;
+    comm_link.prevRate = comm_link.rate;
+    comm__setRate(rate);
+    comm__sendLink(LINK_TEST, rate);
+    comm__linkWait(linkTesting);
+  } else if (cmd == LINK_TEST && !master) {
+    if (comm_link.state != linkTesting || rate != comm_link.rate) return;
+    if (n != 2 + sizeof(comm_testPattern)
+        || memcmp(&data[2], comm_testPattern, sizeof(comm_testPattern)) != 0) return;
+    comm__sendLink(LINK_TEST_OK, rate);
+    comm__linkWait(linkIdle);
+  } else if (cmd == LINK_TEST_OK && master) {
+    if (comm_link.state != linkTesting || rate != comm_link.rate) return;
+    log(LOG_I, "comm: link at %u baud", comm_baudRates[rate]);
+    comm__linkWait(linkIdle);
+  } else if (cmd == LINK_REPORT && master && n >= 3) {
+    if (rate == comm_link.rate) comm_link.otherErrorsPerSec = data[2];
+  }
+}
+
+static void comm__linkTask()
+{
+  if (comm_link.rate != 0 && timer_elapsed(&comm_link.lostTimer)) {
+    // the other half may just have been reset; the rate is only capped by a
+    //   failed test or too many errors
+    log(LOG_E, "Err comm6 link lost at %u baud", comm_baudRates[comm_link.rate]);
+    comm__setRate(0);
+    comm__linkWait(linkIdle);
+    return;
+  }
+  if (comm_link.state != linkIdle && timer_elapsed(&comm_link.timer)) {
+    if (comm_link.state == linkTesting) {
+      log(LOG_C, "Err comm7 test failed at %u baud", comm_baudRates[comm_link.rate]);
+      if (comm__isLinkMaster() && comm_link.rate > 0) comm_link.maxRate = comm_link.rate - 1;
+      comm__setRate(comm_link.prevRate);
+    }
+    comm__linkWait(linkIdle);
+    return;
+  }
+  if (timer_elapsed(&comm_link.qualityTimer)) {
+    timer_enable_ms(&comm_link.qualityTimer, LINK_QUALITY_MS);
+    comm_link.errorsPerSec = comm_bad_frame_count - comm_link.windowErrors;
+    comm_link.framesPerSec = comm_received_frame_count - comm_link.windowFrames;
+    comm_link.windowErrors = comm_bad_frame_count;
+    comm_link.windowFrames = comm_received_frame_count;
+    if (!comm__isLinkMaster()) {
+      if (status.commOK) {
+        uint8_t *data = comm__addRecord(COMM_REC_LINK, 3);
+        data[0] = LINK_REPORT;
+        data[1] = comm_link.rate;
+        data[2] = MIN(comm_link.errorsPerSec, 255);
+        comm_sendFrame();
+      }
+      return;
+    }
+    // the worse of both directions
+    int errorsPerSec = MAX(comm_link.errorsPerSec, comm_link.otherErrorsPerSec);
+    comm_link.otherErrorsPerSec = 0;
+    if (comm_link.state == linkIdle && errorsPerSec > LINK_MAX_ERRORS && comm_link.rate > 0) {
+      log(LOG_E, "Err comm8 %d bad frames/s at %u baud", errorsPerSec, comm_baudRates[comm_link.rate]);
+      comm_link.maxRate = comm_link.rate - 1;
+      comm__proposeRate(comm_link.rate - 1);
+      return;
+    }
+  }
+  if (!comm__isLinkMaster() || comm_link.state != linkIdle || !status.commOK) return;
+  if (timer_elapsed(&comm_link.timer)) {
+    if (comm_link.rate < comm_link.maxRate) {
+      comm__proposeRate(comm_link.rate + 1);
+    } else {
+      timer_disable(&comm_link.timer);
+    }
+  }
+}
+
+// current baud rate, bad frames and frames received in the last second
+void comm_linkStats(uint32_t *baud, int *errorsPerSec, int *framesPerSec)
+{
+  *baud = comm_baudRates[comm_link.rate];
+  *errorsPerSec = comm_link.errorsPerSec;
+  *framesPerSec = comm_link.framesPerSec;
+}
+
+// clock {{{2
+// each half measures the offset of the clock of the other half, as in NTP: a
+// request carries its send time t1; the reply carries t1, the time t2 the
+// request was received and the time t3 the reply was sent; the reply is
+// received at t4. Of CLOCK_SAMPLES measurements, the one with the shortest
+// round trip is used.
+
+#define CLOCK_SYNC_MS 100u
+#define CLOCK_SAMPLES 8
+
+enum { CLOCK_REQUEST, CLOCK_REPLY };
+
+static struct {
+  bool synced;
+  int32_t offset_µs;     // clock of the other half minus ours
+  uint32_t delay_µs;     // round trip of the measurement in use
+  int32_t bestOffset_µs; // best of the current samples
+  uint32_t bestDelay_µs;
+  uint8_t samples;
+  Timer timer;
+} comm_clock;
+
+static void comm__sendClock(uint8_t cmd, uint32_t t1, uint32_t t2)
+{
+  uint8_t *data = comm__addRecord(COMM_REC_CLOCK, 13);
+  data[0] = cmd;
+  comm__put32(&data[1], t1);
+  comm__put32(&data[5], t2);
+  comm__put32(&data[9], time_us_32());
+  comm_sendFrame();
+}
+
+static void comm__receiveClock(uint8_t *data, uint8_t n)
+{
+  uint32_t now = time_us_32();
+  if (n < 13) return;
+  uint32_t t1 = comm__get32(&data[1]);
+  if (data[0] == CLOCK_REQUEST) {
+    comm__sendClock(CLOCK_REPLY, t1, now);
+    return;
+  }
+  uint32_t t2 = comm__get32(&data[5]);
+  uint32_t t3 = comm__get32(&data[9]);
+  uint32_t delay = (now - t1) - (t3 - t2);
+  // in unsigned arithmetic: the clocks can differ by more than 2^31µs
+  int32_t offset = (int32_t)((t2 - t1) - delay / 2);
+  if (comm_clock.samples == 0 || delay < comm_clock.bestDelay_µs) {
+    comm_clock.bestDelay_µs = delay;
+    comm_clock.bestOffset_µs = offset;
+  }
+  if (++comm_clock.samples == CLOCK_SAMPLES) {
+    comm_clock.offset_µs = comm_clock.bestOffset_µs;
+    comm_clock.delay_µs = comm_clock.bestDelay_µs;
+    comm_clock.synced = true;
+    comm_clock.samples = 0;
+  }
+}
+
+static void comm__clockTask()
+{
+  if (!status.commOK) return;
+  if (timer_is_enabled(&comm_clock.timer) && !timer_elapsed(&comm_clock.timer)) return;
+  timer_enable_ms(&comm_clock.timer, CLOCK_SYNC_MS);
+  comm__sendClock(CLOCK_REQUEST, time_us_32(), 0);
+}
+
+// the other half may have been reset, with a new clock
+static void comm__resetClock()
+{
+  comm_clock.synced = false;
+  comm_clock.samples = 0;
+  comm_clock.offset_µs = 0;
+  comm_clock.delay_µs = 0;
+}
+
+// time of our clock corresponding to a time of the other half; before the
+//   clocks are synchronized, the current time. Ages are sent in 16 bits, so a
+//   time outside [now - 65ms, now] comes from a bad offset and is clamped
+static uint32_t comm__localTime(uint32_t remote_µs)
+{
+  if (!comm_clock.synced) return status.now;
+  uint32_t local_µs = remote_µs - comm_clock.offset_µs;
+  int32_t age_µs = status.now - local_µs;
+  if (age_µs < 0) return status.now;
+  if (age_µs > UINT16_MAX) return status.now - UINT16_MAX;
+  return local_µs;
+}
+
+// how long after being scanned a change of the other half may still be on
+//   the link: half the round trip of the clock measurement plus the time to
+//   send a full frame
+uint32_t comm_linkLatency_µs()
+{
+  if (!comm_clock.synced) return EVENT_ORDER_DELAY_US;
+  uint32_t frame_µs = COMM_MAX_FRAME * 10 * 1000000ull / comm_baudRates[comm_link.rate];
+  return MIN(comm_clock.delay_µs / 2 + frame_µs, EVENT_ORDER_DELAY_US);
+}
+
+// offset of the clock of the other half and round trip of its measurement
+void comm_clockStats(int32_t *offset_µs, uint32_t *delay_µs)
+{
+  *offset_µs = comm_clock.offset_µs;
+  *delay_µs = comm_clock.delay_µs;
+}
+
+// retransmits records not acknowledged in time, drops them after too many
+static void comm__retransmitTask()
+{
+  if (comm_switchRate != -1) return; // retries would only fill the held frame
+  for (int slot = 0; slot < COMM_RETX_N; slot++) {
+    if (!comm_retx[slot].pending) continue;
+    if (!status.commOK) {
+      // the link is down; not counted as dropped, its keys wait for the link
+      comm__forgetRecord(slot);
+    } else if (timer_elapsed(&comm_retx[slot].timer)) {
+      if (comm_retx[slot].retries >= COMM_MAX_RETRIES) {
+        comm__dropRecord(slot);
+        continue;
+      }
+      comm_retx[slot].retries++;
+      comm_retransmitted_count++;
+      memcpy(comm__addRecord(COMM_REC_KEYS, comm_retx[slot].len), comm_retx[slot].data, comm_retx[slot].len);
+      timer_enable_ms(&comm_retx[slot].timer, COMM_RETX_MS);
+    }
+  }
+  comm_sendFrame();
+}
+
+static void comm__receiveAcks(uint8_t *data, uint8_t n)
+{
+  for (int i = 0; i + 3 < n; i += 4) {
+    uint32_t seq = comm__get32(&data[i]);
+    for (int slot = 0; slot < COMM_RETX_N; slot++) {
+      if (comm_retx[slot].pending && comm__get32(comm_retx[slot].data) == seq) {
+        comm_retx[slot].pending = false;
+      }
+    }
+  }
+}
+
+static void comm__sendAcks()
+{
+  if (comm_n_acks == 0) return;
+  uint8_t *data = comm__addRecord(COMM_REC_ACK, comm_n_acks * 4);
+  for (int i = 0; i < comm_n_acks; i++) {
+    comm__put32(&data[i * 4], comm_acks[i]);
+  }
+  comm_n_acks = 0;
+  comm_sendFrame();
+}
+
+// retransmitted and dropped keys records
+void comm_retransmitStats(uint32_t *retransmitted, uint32_t *dropped)
+{
+  *retransmitted = comm_retransmitted_count;
+  *dropped = comm_dropped_count;
+}
+
+static void comm__receiveKeys(uint8_t *data, uint8_t n)
+{
+  if (n < COMM_KEYS_HEADER) return;
+  uint32_t seq = comm__get32(&data[0]);
+  uint32_t sendTime = comm__get32(&data[4]);
+  if (comm_n_acks == COMM_MAX_ACKS) comm__sendAcks();
+  comm_acks[comm_n_acks++] = seq;
+  for (int i = COMM_KEYS_HEADER; i + 3 < n; i += 4) {
+    uint8_t keyId = data[i] & 0x7f;
+    bool early = (data[i] & 0x80) != 0;
+    uint8_t val = data[i + 1];
+    uint32_t time = comm__localTime(sendTime - (data[i + 2] | (data[i + 3] << 8)));
+    Key *key = Key_keyWithId(keyId);
+    if (key == NULL || val > TRAVEL_MAX) {
+      comm_error_count++;
+      log(LOG_C, "Err comm3 invalid key: [%02hhx %02hhx] %d/%d", data[i], val, comm_error_count, comm_received_frame_count);
+      continue;
+    }
+    // ignore repeated records and values older than the one applied
+    if (comm_keySeqValid[keyId] && (int32_t)(seq - comm_keySeq[keyId]) <= 0) continue;
+    comm_keySeq[keyId] = seq;
+    comm_keySeqValid[keyId] = true;
+    key_setVal(key, val, time);
+    if (early) key_earlyPress(key);
+  }
+}
+
 void comm_task()
 {
-  uint8_t msgVal;
-  uint8_t msgId;
-  while (comm_receiveMessage(&msgId, &msgVal)) {
+  uint8_t payload[COMM_MAX_PAYLOAD];
+  uint8_t len;
+  // before receiving: the other half may already be at the new rate
+  comm__switchRateTask();
+  while (comm__receiveFrame(payload, &len)) {
     status.commOK = true;
     timer_enable_ms(&recv_timer, COMM_STATUS_DELAY_MS * 2);
-    Key *key = Key_keyWithId(msgId);
-    if (key != NULL) {
-      if (msgVal > 9) {
+    timer_enable_ms(&comm_link.lostTimer, LINK_LOST_MS);
+    for (int i = 0; i + 2 <= len; ) {
+      uint8_t type = payload[i];
+      uint8_t n = payload[i + 1];
+      uint8_t *data = &payload[i + 2];
+      i += 2 + n;
+      if (i > len) {
         comm_error_count++;
-        log(LOG_C, "Err comm2 invalid value: [%02hhx %02hhx] %d/%d", msgId, msgVal, comm_error_count, comm_received_message_count);
+        log(LOG_C, "Err comm4 record length: [%02hhx %02hhx] %d/%d", type, n, comm_error_count, comm_received_frame_count);
+        break;
+      }
+      if (type == COMM_REC_KEYS) {
+        comm__receiveKeys(data, n);
+      } else if (type == COMM_REC_STATUS && n >= 1) {
+        status.otherSide          = ((data[0] & 0b0001) == 0) ? leftSide : rightSide;
+        status.otherSideUsbReady  = ((data[0] & 0b0010) != 0);
+        status.otherSideUsbActive = ((data[0] & 0b0100) != 0);
+        status.otherSideToggleUsb = ((data[0] & 0b1000) != 0);
+      } else if (type == COMM_REC_LINK && n >= 2) {
+        comm__receiveLink(data, n);
+      } else if (type == COMM_REC_CLOCK) {
+        comm__receiveClock(data, n);
+      } else if (type == COMM_REC_ACK) {
+        comm__receiveAcks(data, n);
       } else {
-        key_setVal(key, msgVal);
+        log(LOG_C, "comm: unknown record type %d", type);
       }
-    } else if (msgId == 62) {
-      status.otherSide          = ((msgVal & 0b0001) == 0) ? leftSide : rightSide;
-      status.otherSideUsbReady  = ((msgVal & 0b0010) != 0);
-      status.otherSideUsbActive = ((msgVal & 0b0100) != 0);
-      status.otherSideToggleUsb = ((msgVal & 0b1000) != 0);
-    } else {
-      comm_error_count++;
-      log(LOG_C, "Err comm3 invalid id: [%02hhx %02hhx] %d/%d", msgId, msgVal, comm_error_count, comm_received_message_count);
     }
   }
-  if (status.commOK && timer_elapsed(&recv_timer))
+  comm__sendAcks();
+  if (status.commOK && timer_elapsed(&recv_timer)) {
     status.commOK = false;
+    // the other half may have been reset, with new sequence numbers
+    memset(comm_keySeqValid, 0, sizeof(comm_keySeqValid));
+    comm__resetClock();
+  }
+  comm__retransmitTask();
+  comm__linkTask();
+  comm__clockTask();
 }
 
 
@@ -1323,65 +2284,120 @@ struct key {
   Controller *controller;
   // key id, O-17 for left (0=Q,1=W), 18-35 for right (18=Y,19=U)
   int8_t keyId;
-  // current state, a 0 to 9 value and a pressed state
-  int8_t val;
+  // current state, a 0 to TRAVEL_MAX value and a pressed state
+  uint8_t val;
   bool pressed;
   bool valChanged;
   bool pressChanged;
+  bool earlyChanged; // early press not yet sent to the other side
+  // time of an early press not yet confirmed by reaching actuation, 0 if none
+  uint32_t earlyPressTime;
+  // when the current value was scanned and when the pressed state changed,
+  //   in our clock (also for keys of the other half)
+  uint32_t valTime_µs;
+  uint32_t pressTime_µs;
+  // minimum value since key was released and maximum value since key was pressed
+  //   a key press/release is recognized relative to these values
+  uint8_t minVal;
+  uint8_t maxVal;
+  // use rapid trigger even if the layer does not
+  bool rapidTrigger;
+  // the current press uses rapid trigger (decided when pressed)
+  bool pressedRapid;
+  // presses in the current health window; a quarantined key is ignored
+  uint8_t recentPresses;
+  uint32_t healthWindowStart;
+  bool quarantined;
   // what to do when key is released
   Action releaseAction;
-  // key can be analog or digital
-  union {
-    struct {
-      // last value read from sensor
-      uint16_t rawAnalogValue;
-      uint16_t minRawRange;
-      // scaled values, for filtering
-      uint32_t minRaw_S;
-      uint32_t maxRaw_S;
-      uint32_t filteredRaw_S;
-      // minimum value since key was released and maximum value since key was pressed
-      //   a key press/release is recognized relative to these values
-      int8_t minVal;
-      int8_t maxVal;
-    } /*analog*/;
-    struct {
-      bool lastDigitalValue;
-      bool rawDigitalValue;
-      bool ignoreNewValues;
-      Timer debounceTimer;
-    } /*digital*/;
-  };
+  // debounced value of a digital key (the state of analog keys is in AnalogKeys)
+  bool rawDigitalValue;
   Key *next; // to implement lists of keys in Controller
 };
 
 Key keys[N_KEYS];
 
+// actuation and release points of each key, indexed by key id;
+//   a key is pressed when its value reaches actuation, and released when
+//   it gets down to release (rapid trigger does not use them)
+struct keyTrigger {
+  uint8_t actuation;
+  uint8_t release;
+} keyTrigger[N_KEYS];
+
 static void key__sendIfChanged(Key *self);
 
 void Key_init(Controller *controller)
 {
   for (uint8_t keyId = 0; keyId < N_KEYS; keyId++) {
     key_init(&keys[keyId], controller, keyId);
+    key_setRapidTrigger(&keys[keyId], (RAPID_TRIGGER_KEYS >> keyId) & 1);
+    key_setTriggerPoints(&keys[keyId], ACTUATION_VAL, RELEASE_VAL);
   }
 
 }
 
 Key *Key_keyWithId(uint8_t keyId)
 {
-  if (keyId > N_KEYS) return NULL;
+  if (keyId >= N_KEYS) return NULL;
   return &keys[keyId];
 }
 
-void Key_processKeyChanges()
+// apply the values produced by the scanner on the other core
+void Key_processScannedVals()
+{
+  uint8_t keyId;
+  uint8_t val;
+  bool early;
+  uint32_t time_µs;
+  while (scanq_remove(&scanq, &keyId, &val, &early, &time_µs)) {
+    key_setVal(Key_keyWithId(keyId), val, time_µs);
+    if (early) key_earlyPress(Key_keyWithId(keyId));
+  }
+}
+
+// true if some key of the other half is off its rest position, so that a
+//   change of it may be on the link
+static bool Key__otherSideMoving()
 {
   for (uint8_t keyId = 0; keyId < N_KEYS; keyId++) {
-    key_processChanges(&keys[keyId]);
+    Key *key = &keys[keyId];
+    if (key->keyId != -1 && key_side(key) != status.mySide && key->val != 0) return true;
+  }
+  return false;
+}
+
+// changes are processed oldest first, so that tap/hold decisions see key
+//   presses and releases of both halves in the order they happened; changes
+//   of the other half come with the link latency, and are not held back
+void Key_processKeyChanges()
+{
+  int32_t delay_µs = 0;
+  if (status.commOK && Key__otherSideMoving()) delay_µs = comm_linkLatency_µs();
+  while (true) {
+    Key *oldest = NULL;
+    int32_t oldestAge = 0;
+    for (uint8_t keyId = 0; keyId < N_KEYS; keyId++) {
+      Key *key = &keys[keyId];
+      if (key->keyId == -1 || !key->pressChanged) continue;
+      int32_t age = status.now - key->pressTime_µs;
+      if (age < 0) age = 0;
+      if (oldest == NULL || age > oldestAge) {
+        oldest = key;
+        oldestAge = age;
+      }
+    }
+    if (oldest == NULL) return;
+    if (key_side(oldest) == status.mySide && oldestAge < delay_µs) return;
+    key_processChanges(oldest);
   }
 }
 
+// while the link is down, changed keys are only marked (valChanged stays
+//   set), and their current values are sent when it is back
 void Key_sendChangedKeys(keyboardSide side)
 {
+  if (!status.commOK) return;
   uint8_t firstKeyId, lastKeyId;
   if (side == leftSide) {
     firstKeyId = 0;
@@ -1394,6 +2410,8 @@ void Key_sendChangedKeys(keyboardSide side)
     Key *key = &keys[keyId];
     key__sendIfChanged(key);
   }
+  // all changes in a single frame
+  comm_sendFrame();
 }
 
 char *key_description(Key *self)
@@ -1408,7 +2426,6 @@ void key_init(Key *self, Controller *controller, uint8_t keyId)
   memset(self, 0, sizeof(*self));
   self->controller = controller;
   self->keyId = keyId;
-  self->filteredRaw_S = UINT32_MAX;
   self->val = 0;
   self->pressed = false;
   self->minVal = 0;
@@ -1426,45 +2443,6 @@ keyboardSide key_side(Key *self)
   return noSide;
 }
 
-void key_setMinRawRange(Key *self, uint16_t range)
-{
-  self->minRawRange = range;
-}
-
-static void filter_SS(uint32_t *old_S, uint32_t new_S, uint8_t weight)
-{
-  *old_S = *old_S + (new_S >> weight) - (*old_S >> weight);
-}
-static void filter_SnS(uint32_t *old_S, uint16_t new, uint8_t scale, uint8_t weight)
-{
-  filter_SS(old_S, ((uint32_t)new) << scale, weight);
-}
-static void key__filterRawValue(Key *self)
-{
-  if (self->filteredRaw_S == UINT32_MAX) {
-    // if it's the first value, initialize
-    self->filteredRaw_S = self->rawAnalogValue << 13;
-    self->maxRaw_S = self->filteredRaw_S;
-    self->minRaw_S = self->filteredRaw_S;
-    return;
-  }
-  filter_SnS(&self->filteredRaw_S, self->rawAnalogValue, 13, 2);
-  // if value is outside of max or min limits, fast drift min or max to value
-  if (self->filteredRaw_S < self->minRaw_S) {
-    filter_SS(&self->minRaw_S, self->filteredRaw_S, 1);
-  } else if (self->filteredRaw_S > self->maxRaw_S) {
-    filter_SS(&self->maxRaw_S, self->filteredRaw_S, 1);
-  } else {
-    // if value is close to max or min, slowly drift min or max to value
-    uint32_t dist = (self->maxRaw_S - self->minRaw_S) / 3;
-    if ((self->filteredRaw_S - self->minRaw_S) < dist) {
-      filter_SS(&self->minRaw_S, self->filteredRaw_S, 13);
-    } else if ((self->maxRaw_S - self->filteredRaw_S) < dist) {
-      filter_SS(&self->maxRaw_S, self->filteredRaw_S, 13);
-    }
-  }
-}
-
 void key_processChanges(Key *self)
 {
   if (self->keyId == -1) return;
@@ -1483,11 +2461,23 @@ void key__sendIfChanged(Key *self)
   if (self->keyId == -1) return;
   if (self->valChanged) {
     self->valChanged = false;
-    comm_sendMessage(self->keyId, self->val);
+    comm_addKeyVal(self->keyId, self->val, self->earlyChanged, self->valTime_µs);
+    self->earlyChanged = false;
   }
 }
 
-int8_t key_val(Key *self)
+// the current value is sent again to the other half
+void key_resendVal(Key *self)
+{
+  self->valChanged = true;
+}
+
+bool key_isPressed(Key *self)
+{
+  return self->pressed;
+}
+
+uint8_t key_val(Key *self)
 {
   return self->val;
 }
@@ -1502,67 +2492,193 @@ Action *key_releaseAction(Key *self)
   return &self->releaseAction;
 }
 
-void key_setVal(Key *self, uint8_t newVal)
+void key_setRapidTrigger(Key *self, bool rapidTrigger)
 {
-  if (self->keyId == -1) return;
-  if (newVal == self->val) return;
-  self->val = newVal;
+  self->rapidTrigger = rapidTrigger;
+}
+
+// returns false if the points are not valid (0 <= release < actuation <= TRAVEL_MAX)
+bool key_setTriggerPoints(Key *self, int actuation, int release)
+{
+  if (release < 0 || actuation > TRAVEL_MAX || release >= actuation) return false;
+  keyTrigger[self->keyId].actuation = actuation;
+  keyTrigger[self->keyId].release = release;
+  return true;
+}
+
+static bool key__holdsLayer(Key *self, layer_id_t layer_id)
+{
+  Action *action = &layer[layer_id][self->keyId];
+  return action_holdType(action) == layerHoldType
+      || action->action_type == hold_layer_action;
+}
+
+// a key that holds a layer does not use the rapid trigger of a layer, so
+//   that a small lift does not drop the layer
+static bool key__usesRapidTrigger(Key *self)
+{
+  if (self->rapidTrigger) return true;
+  layer_id_t current = controller_currentLayer(self->controller);
+  if (!layerRapidTrigger[current]) return false;
+  return !key__holdsLayer(self, current)
+      && !key__holdsLayer(self, controller_baseLayer(self->controller));
+}
+
+bool key_isQuarantined(Key *self)
+{
+  return self->quarantined;
+}
+
+// a quarantined key is released, also on the other half if it is ours
+void key_setQuarantined(Key *self, bool quarantined)
+{
+  if (quarantined == self->quarantined) return;
+  self->quarantined = quarantined;
+  self->recentPresses = 0;
+  if (quarantined) {
+    self->val = 0;
+    self->valTime_µs = status.now;
+    self->valChanged = true;
+    self->earlyChanged = false;
+  }
+  if (quarantined && self->pressed) {
+    self->pressed = false;
+    // cancels the press if not yet processed, else releases the key
+    self->pressChanged = !self->pressChanged;
+    self->pressTime_µs = status.now;
+    self->earlyPressTime = 0;
+  }
+}
+
+// quarantines the key if it is pressed too often; only the half that runs
+//   the controller counts, as the other one does not know all trigger modes
+static void key__countPress(Key *self)
+{
+  if (!status.usbActive) return;
+  if (status.now - self->healthWindowStart > HEALTH_WINDOW_MS * 1000) {
+    self->healthWindowStart = status.now;
+    self->recentPresses = 0;
+  }
+  if (++self->recentPresses > HEALTH_MAX_PRESSES) {
+    log(LOG_E, "k%d quarantined: %d presses in %dms",
+        self->keyId, self->recentPresses, HEALTH_WINDOW_MS);
+    key_setQuarantined(self, true);
+  }
+}
+
+// early presses: confirmed ones, false triggers and sum of time gained
+//   (from early press to reaching actuation) of the confirmed ones
+struct earlyPressStats {
+  uint32_t count;
+  uint32_t falseCount;
+  uint32_t leadSum_µs;
+} earlyPressStats;
+
+// the scanner saw the key clearly moving down
+void key_earlyPress(Key *self)
+{
+  if (self->keyId == -1 || self->quarantined) return;
+  self->earlyChanged = true;
+  self->valChanged = true;
+  if (self->pressed || key__usesRapidTrigger(self)) return;
+  if (self->val >= keyTrigger[self->keyId].actuation) return;
+  self->maxVal = self->val;
+  self->pressed = true;
+  self->pressedRapid = false;
+  self->pressChanged = true;
+  self->pressTime_µs = self->valTime_µs;
+  self->earlyPressTime = status.now;
+  key__countPress(self);
+}
+
+// returns true if an early press turned out to be false
+static bool key__checkEarlyPress(Key *self, uint8_t newVal)
+{
+  if (self->earlyPressTime == 0) return false;
+  if (newVal >= keyTrigger[self->keyId].actuation) {
+    earlyPressStats.count++;
+    earlyPressStats.leadSum_µs += status.now - self->earlyPressTime;
+    self->earlyPressTime = 0;
+    return false;
+  }
+  if (self->maxVal - newVal >= EARLY_PRESS_MIN_RISE) {
+    earlyPressStats.falseCount++;
+    self->earlyPressTime = 0;
+    return true;
+  }
+  return false;
+}
+
+void key_setVal(Key *self, uint8_t newVal, uint32_t time_µs)
+{
+  if (self->keyId == -1 || self->quarantined) return;
+  if (newVal == self->val) return;
+  self->val = newVal;
+  self->valTime_µs = time_µs;
   self->valChanged = true;
+  bool wasPressed = self->pressed;
+  // a press is released in the mode it was pressed, even if the layer changed
+  bool rapid = self->pressed ? self->pressedRapid : key__usesRapidTrigger(self);
 
-  if (self->pressed) {
+  if (rapid) {
+    if (self->pressed) {
+      self->maxVal = MAX(self->maxVal, newVal);
+      if (self->maxVal - newVal >= RAPID_TRIGGER_SENSITIVITY
+          || newVal < RAPID_TRIGGER_MIN_VAL) {
+        self->minVal = newVal;
+        self->pressed = false;
+        self->pressChanged = true;
+      }
+    } else {
+      self->minVal = MIN(self->minVal, newVal);
+      if (newVal - self->minVal >= RAPID_TRIGGER_SENSITIVITY
+          && newVal >= RAPID_TRIGGER_MIN_VAL) {
+        self->maxVal = newVal;
+        self->pressed = true;
+        self->pressChanged = true;
+      }
+    }
+  } else if (self->pressed) {
     self->maxVal = MAX(self->maxVal, newVal);
-    if (self->maxVal - newVal >= SENSITIVITY) {
+    bool early = self->earlyPressTime != 0;
+    if (key__checkEarlyPress(self, newVal)
+        || (!early && newVal <= keyTrigger[self->keyId].release)) {
       self->minVal = newVal;
       self->pressed = false;
       self->pressChanged = true;
     }
   } else {
     self->minVal = MIN(self->minVal, newVal);
-    if (newVal - self->minVal >= SENSITIVITY) {
+    if (newVal >= keyTrigger[self->keyId].actuation) {
       self->maxVal = newVal;
       self->pressed = true;
       self->pressChanged = true;
     }
   }
+  if (self->pressed != wasPressed) self->pressTime_µs = time_µs;
+  if (self->pressed && !wasPressed) self->pressedRapid = rapid;
+  if (self->pressed && !wasPressed) key__countPress(self);
   //log(LOG_K, "newVal k%d %d->%d m%d M%d p%d",
   //    self->keyId, self->val, newVal, self->minVal, self->maxVal, self->pressed);
 }
 
-static int constrain(int val, int minimum, int maximum)
-{
-  if (val < minimum) return minimum;
-  if (val > maximum) return maximum;
-  return val;
-}
-
-void key_setNewAnalogRaw(Key *self, uint16_t newRaw)
+// called by the scanner with a new value for the key
+static bool key__publishVal(Key *self, uint8_t newVal, bool early)
 {
-  self->rawAnalogValue = newRaw;
-  key__filterRawValue(self);
-  if (self->keyId == -1) return;
-  int minRaw = self->minRaw_S >> 13;
-  int maxRaw = self->maxRaw_S >> 13;
-  int rawRange = maxRaw - minRaw;
-  if (rawRange < self->minRawRange) return;
-  int old_val_90 = self->val * 10;
-  int new_val_90 = constrain((newRaw - minRaw) * 100 / rawRange, 0, 90);
-  if (abs(new_val_90 - old_val_90) > 6) {
-    int8_t newVal = (new_val_90 + 5) / 10;
-    key_setVal(self, newVal);
+  if (SCAN_ON_CORE1) {
+    return scanq_insert(&scanq, self->keyId, newVal, early, time_us_32());
   }
+  key_setVal(self, newVal, time_us_32());
+  if (early) key_earlyPress(self);
+  return true;
 }
 
-void key_setNewDigitalRaw(Key *self, bool newRaw)
+// receives a debounced value; returns false if it could not be published (try again)
+bool key_setNewDigitalRaw(Key *self, bool newRaw)
 {
+  if (!key__publishVal(self, newRaw ? TRAVEL_MAX : 0, false)) return false;
   self->rawDigitalValue = newRaw;
-  if (self->ignoreNewValues && timer_elapsed(&self->debounceTimer))
-    self->ignoreNewValues = false;
-  if (self->ignoreNewValues) return;
-  if (newRaw == self->lastDigitalValue) return;
-  self->lastDigitalValue = newRaw;
-  timer_enable_ms(&self->debounceTimer, DEBOUNCING_DELAY_MS);
-  self->ignoreNewValues = true;
-  key_setVal(self, newRaw ? 9 : 0);
+  return true;
 }
 
 // KeyList {{{1
@@ -1706,6 +2822,10 @@ struct controller {
   int16_t mousePos_h;
   int16_t mousePos_wv;
   int16_t mousePos_wh;
+  bool gamepadLayer;
+  bool gamepadActive;
+  hid_gamepad_report_t gamepad;
+  int16_t gamepadAxis[gp_rz + 1];
   Action delayedReleaseAction;
   modifier_t modifiers;
   bool wordLocked;
@@ -1722,6 +2842,7 @@ static void controller__setCurrentLayer(Controller *self, layer_id_t layer_id)
   } else {
     timer_disable(&self->moveMouseTimer);
   }
+  self->gamepadLayer = layer_hasGamepadAction(layer_id);
 }
 void controller_init(Controller *self, USB *usb)
 {
@@ -1876,6 +2997,11 @@ layer_id_t controller_baseLayer(Controller *self)
   return self->baseLayer;
 }
 
+layer_id_t controller_currentLayer(Controller *self)
+{
+  return self->currentLayer;
+}
+
 static void controller__pressKey(Controller *self, Key *key)
 {
   Action action = layer[self->currentLayer][key_id(key)];
@@ -1883,6 +3009,10 @@ static void controller__pressKey(Controller *self, Key *key)
     log(LOG_T, "ignoring mouse movement key press");
     return;
   }
+  if (action_isGamepadAction(&action)) {
+    log(LOG_T, "ignoring gamepad key press");
+    return;
+  }
   log(LOG_T, "pressKey %s %s", key_description(key), action_description(&action));
   key_setReleaseAction(key, Action_noAction()); // just in case...
   if (key_side(key) == self->holdSide) {
@@ -2232,6 +3362,48 @@ static void controller__timedMoveMouse(Controller *self)
   timer_enable_ms(&self->moveMouseTimer, MOUSE_PERIOD_MS);
 }
 
+void controller_moveGamepadAxis(Controller *self, int axis, int amount)
+{
+  self->gamepadAxis[axis] += amount;
+}
+void controller_pressGamepadButton(Controller *self, uint8_t button)
+{
+  self->gamepad.buttons |= 1u << button;
+}
+static int8_t controller__gamepadAxis(Controller *self, int neg, int pos)
+{
+  int v = self->gamepadAxis[pos] - (neg == -1 ? 0 : self->gamepadAxis[neg]);
+  if (v > 127) v = 127;
+  if (v < -127) v = -127;
+  return v;
+}
+static void controller__updateGamepad(Controller *self)
+{
+  // after leaving the layer, one last (empty) report is set
+  if (!self->gamepadLayer && !self->gamepadActive) return;
+  self->gamepadActive = self->gamepadLayer;
+  memset(&self->gamepad, 0, sizeof(self->gamepad));
+  memset(self->gamepadAxis, 0, sizeof(self->gamepadAxis));
+  if (self->gamepadLayer) {
+    // gamepad actions call controller_moveGamepadAxis and controller_pressGamepadButton
+    for (uint8_t k = 0; k < N_KEYS; k++) {
+      Action *action = &layer[self->currentLayer][k];
+      if (action_isGamepadAction(action)) {
+        Key *key = Key_keyWithId(k);
+        action_actuate(action, key, self);
+      }
+    }
+  }
+  self->gamepad.x  = controller__gamepadAxis(self, gp_left,  gp_right);
+  self->gamepad.y  = controller__gamepadAxis(self, gp_up,    gp_down);
+  self->gamepad.rx = controller__gamepadAxis(self, gp_rleft, gp_rright);
+  self->gamepad.ry = controller__gamepadAxis(self, gp_rup,   gp_rdown);
+  self->gamepad.z  = controller__gamepadAxis(self, -1,       gp_z);
+  self->gamepad.rz = controller__gamepadAxis(self, -1,       gp_rz);
+  self->gamepad.hat = GAMEPAD_HAT_CENTERED;
+  usb_setGamepad(self->usb, &self->gamepad);
+}
+
 void controller_doCommand(Controller *self, int command)
 {
   if (command == WORDLOCK) {
@@ -2244,6 +3416,27 @@ void controller_doCommand(Controller *self, int command)
     printf("CMD: USB_SIDE\n");
     status.toggleUsb = true;
     return;
+  } else if (command == SETTLE_CAL) {
+    printf("CMD: SETTLE_CAL\n");
+    analogScan_requestCalibration();
+    return;
+  } else if (command == RAPID_TRIG) {
+    layer_id_t base = self->baseLayer;
+    layerRapidTrigger[base] = !layerRapidTrigger[base];
+    printf("CMD: RAPID_TRIG %s\n", layerRapidTrigger[base] ? "on" : "off");
+    return;
+  } else if (command == XTALK_CAL) {
+    printf("CMD: XTALK_CAL\n");
+    analogKeys_requestCrosstalkCalibration();
+    return;
+  } else if (command == LUT_CAL) {
+    printf("CMD: LUT_CAL\n");
+    analogKeys_requestLutCalibration();
+    return;
+  } else if (command == SAVE_CAL) {
+    printf("CMD: SAVE_CAL\n");
+    calStore_requestSave();
+    return;
   }
   printf("%s(%d) not implemented\n", __func__, command);
   printf("Layers: current=%d base=%d\n", self->currentLayer, self->baseLayer);
@@ -2260,249 +3453,1943 @@ void controller_task(Controller *self)
   if (timer_elapsed(&self->moveMouseTimer)) {
     controller__timedMoveMouse(self);
   }
+  controller__updateGamepad(self);
   if (timer_elapsed(&self->waitingKeyTimer)) {
     log(LOG_T, "hold timeout");
     controller_holdWaitingKeysUntilKey(self, NULL);
   }
 }
 
-// LocalReader {{{1
-// reads the keys physically connected to local microcontroller
-typedef struct {
-  uint8_t *sel_pins;
-  keyboardSide side;
-  keyboardType kb_type;
-  int8_t hw_version;
-  int8_t *hwIdToKeyId;
-} LocalReader;
+// AnalogScan {{{1
+// scans the analog keys in background.
+// a PIO state machine (selector.pio) drives the selector lines, with exact
+// settle times, and raises an irq when a line is on; for each line, the ADC
+// converts all analog inputs ADC_OVERSAMPLING times in round-robin mode into
+// its FIFO, and DMA moves the samples to a frame buffer.
+// the ADC cannot be started by PIO, so the CPU intervenes in two short
+// interrupt handlers: to start the ADC and to give the next line to the PIO.
+// complete frames are consumed by LocalReader.
+// while idle, frames are started one by one, with less oversampling.
+// there are 2 frame buffers: while a frame is ready (not yet consumed),
+// the DMA fills the other one; if the consumer is late, frames are dropped.
+
+#define SEL_PIO pio1
+// selector state machine frequency; settle times are counted in its cycles
+#define SEL_PIO_FREQ 1000000
+
+static struct {
+  uint sm;
+  int dma_chan;
+  uint32_t sel_masks[N_SEL_PINS];  // selector pins, relative to the PIO out pin base
+  uint16_t settle_µs[N_SEL_PINS];  // time to wait before turning each line on
+  uint8_t sel;         // selector line being converted
+  uint8_t fillBuf;     // frame buffer being filled by DMA
+  uint8_t readyBuf;    // last complete frame, owned by consumer while frameReady
+  volatile bool frameReady;
+  volatile bool freeRunning; // if false, stop after each frame
+  volatile bool stopped;
+  uint16_t frameCount;
+  uint8_t oversampling[2];     // of the frame in each buffer
+  uint32_t frameStart_µs;      // first line of the frame being filled on
+  volatile uint16_t frame_µs[2]; // last full and reduced frame, from first line on
+  volatile uint16_t tempRaw;   // last reading of the temperature sensor
+  volatile uint32_t tempCount; // number of readings
+  uint16_t samples[2][N_SEL_PINS][N_LINE_SAMPLES];
+} analogScan;
+
+// the PIO turns all lines off when it receives the settle time,
+// and starts the settle delay when it receives the mask of the next line
+static void analogScan__putSettle()
+{
+  uint32_t settle_cycles = analogScan.settle_µs[analogScan.sel] * (SEL_PIO_FREQ / 1000000);
+  pio_sm_put(SEL_PIO, analogScan.sm, settle_cycles);
+}
+
+static void analogScan__putMask()
+{
+  pio_sm_put(SEL_PIO, analogScan.sm, analogScan.sel_masks[analogScan.sel]);
+}
+
+static void analogScan__lineOn()
+{
+  pio_interrupt_clear(SEL_PIO, 0);
+  if (analogScan.sel == 0) {
+    analogScan.frameStart_µs = time_us_32();
+    uint8_t oversampling = analogScan.freeRunning ? ADC_OVERSAMPLING : IDLE_ADC_OVERSAMPLING;
+    analogScan.oversampling[analogScan.fillBuf] = oversampling;
+    dma_channel_set_trans_count(analogScan.dma_chan, N_ANA_PINS * oversampling, false);
+  }
+  adc_select_input(0);
+  dma_channel_set_write_addr(analogScan.dma_chan,
+                             analogScan.samples[analogScan.fillBuf][analogScan.sel],
+                             true);
+  adc_run(true);
+}
+
+// one conversion of the temperature sensor (ADC input 4), between frames
+static void analogScan__readTemperature()
+{
+  adc_select_input(4);
+  analogScan.tempRaw = adc_read();
+  adc_fifo_drain();
+  analogScan.tempCount++;
+}
+
+static void analogScan__lineDone()
+{
+  dma_channel_acknowledge_irq0(analogScan.dma_chan);
+  adc_run(false);
+  adc_fifo_drain();
+  analogScan.sel++;
+  if (analogScan.sel == N_SEL_PINS) {
+    analogScan.sel = 0;
+    bool reduced = analogScan.oversampling[analogScan.fillBuf] < ADC_OVERSAMPLING;
+    analogScan.frame_µs[reduced] = time_us_32() - analogScan.frameStart_µs;
+    if (++analogScan.frameCount % TEMP_FRAMES == 0) analogScan__readTemperature();
+    if (!analogScan.frameReady) {
+      analogScan.readyBuf = analogScan.fillBuf;
+      analogScan.fillBuf ^= 1;
+      analogScan.frameReady = true;
+    }
+    if (!analogScan.freeRunning) {
+      // lines and ADC are turned off while stopped
+      analogScan__putSettle();
+      hw_clear_bits(&adc_hw->cs, ADC_CS_EN_BITS);
+      analogScan.stopped = true;
+      return;
+    }
+  }
+  analogScan__putSettle();
+  analogScan__putMask();
+}
 
-void localReader__initAnalogGPIO(LocalReader *self)
+static void analogScan__initPio(uint8_t *sel_pins)
 {
-  adc_init();
-  for (int i = 0; i < N_ANA_PINS; i++) {
-    adc_gpio_init(ana_pins[i]);
+  // PIO drives consecutive pins (wrapping at 32);
+  // choose the base pin that gives the shortest range containing all selector pins.
+  // only the selector pins are given to the PIO, the others in the range are unaffected
+  uint base = sel_pins[0], count = 32;
+  for (int b = 0; b < N_SEL_PINS; b++) {
+    uint span = 0;
+    for (int i = 0; i < N_SEL_PINS; i++) {
+      span = MAX(span, ((sel_pins[i] - sel_pins[b]) & 31) + 1);
+    }
+    if (span < count) {
+      base = sel_pins[b];
+      count = span;
+    }
   }
+  uint32_t pin_mask = 0;
   for (int i = 0; i < N_SEL_PINS; i++) {
-    uint pin = self->sel_pins[i];
-    gpio_init(pin);
-    gpio_set_dir(pin, GPIO_OUT);
+    analogScan.sel_masks[i] = 1u << ((sel_pins[i] - base) & 31);
+    pin_mask |= analogScan.sel_masks[i];
   }
+
+  analogScan.sm = pio_claim_unused_sm(SEL_PIO, true);
+  uint offset = pio_add_program(SEL_PIO, &selector_program);
+  selector_program_init(SEL_PIO, analogScan.sm, offset, base, count, pin_mask, SEL_PIO_FREQ);
+  pio_set_irq0_source_enabled(SEL_PIO, pis_interrupt0, true);
+  irq_set_exclusive_handler(PIO1_IRQ_0, analogScan__lineOn);
+  irq_set_enabled(PIO1_IRQ_0, true);
 }
 
-void localReader__initDigitalGPIO(LocalReader *self)
+void analogScan_startFrame();
+
+// interrupts are handled by the core that calls this
+void analogScan_init(uint8_t *sel_pins)
 {
-  for (int pin = 0; pin < N_DIGITAL_HWKKEYS; pin++) {
-    if (self->hwIdToKeyId[pin] != -1) {
-      gpio_init(pin);
-      gpio_set_dir(pin, GPIO_IN);
-      gpio_pull_up(pin);
-    }
+  analogScan.sel = 0;
+  analogScan.fillBuf = 0;
+  analogScan.frameReady = false;
+  analogScan.freeRunning = true;
+  analogScan.stopped = false;
+  for (int sel = 0; sel < N_SEL_PINS; sel++) {
+    analogScan.settle_µs[sel] = SEL_SETTLE_DELAY_US;
   }
+
+  adc_set_temp_sensor_enabled(true);
+  analogScan__readTemperature();
+  adc_set_round_robin((1u << N_ANA_PINS) - 1);
+  adc_fifo_setup(true, true, 1, false, false);
+  adc_set_clkdiv(0);
+
+  analogScan.dma_chan = dma_claim_unused_channel(true);
+  dma_channel_config c = dma_channel_get_default_config(analogScan.dma_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, true);
+  channel_config_set_dreq(&c, DREQ_ADC);
+  dma_channel_configure(analogScan.dma_chan, &c,
+                        NULL, &adc_hw->fifo, N_LINE_SAMPLES, false);
+  dma_channel_set_irq0_enabled(analogScan.dma_chan, true);
+  irq_set_exclusive_handler(DMA_IRQ_0, analogScan__lineDone);
+  irq_set_enabled(DMA_IRQ_0, true);
+
+  analogScan__initPio(sel_pins);
+  analogScan__putSettle();
+  analogScan__putMask();
 }
 
-static uint16_t readPin(uint sel, uint ana)
+// returns the last complete frame, or NULL if there is none.
+// the frame must be released after use.
+uint16_t (*analogScan_frame())[N_LINE_SAMPLES]
 {
-  adc_select_input(ana);
-  gpio_init(sel);
-  gpio_set_dir(sel, GPIO_OUT);
-  gpio_put(sel, 1);
-  uint16_t raw = adc_read();
-  gpio_put(sel, 0);
-  sleep_us(250);
-  return raw;
+  if (!analogScan.frameReady) return NULL;
+  return analogScan.samples[analogScan.readyBuf];
 }
 
-int v1, v2;
-static bool detect_resistor(uint8_t pin1, uint8_t pin2)
+// conversions of each input in the ready frame
+static inline uint8_t analogScan_oversampling()
 {
-  // can only detect resistor connecting analog pins (26 to 29)
-  if (pin1 < 26 || pin1 > 29 || pin2 < 26 || pin2 > 29) return false;
-  uint8_t adc1 = pin1 - 26;
-  adc_init();
-  adc_gpio_init(pin1);
-  adc_select_input(adc1);
-  gpio_init(pin2);
-  gpio_set_dir(pin2, GPIO_OUT);
-  gpio_put(pin2, false);
-  sleep_us(500);
-  v1 = adc_read();
-  gpio_put(pin2, true);
-  sleep_us(500);
-  v2 = adc_read();
-  gpio_deinit(28);
-  return abs(v1 - v2) > 500;
+  return analogScan.oversampling[analogScan.readyBuf];
 }
-static bool detect_connection(uint8_t pin1, uint8_t pin2)
+
+// decimates the samples of one analog input in a line of the ready frame
+static inline uint16_t analogScan_raw(uint16_t line[N_LINE_SAMPLES], int ana)
 {
-  bool v1, v2;
-  gpio_init(pin1);
-  gpio_set_dir(pin1, GPIO_IN);
-  gpio_init(pin2);
-  gpio_set_dir(pin2, GPIO_OUT);
-  gpio_put(pin2, false);
-  sleep_us(10);
-  v1 = gpio_get(pin1);
-  gpio_put(pin2, true);
-  sleep_us(10);
-  v2 = gpio_get(pin1);
-  gpio_deinit(pin1);
-  gpio_deinit(pin2);
-  return !v1 && v2;
+  // samples in a line are interleaved by round-robin: input of sample i is i % N_ANA_PINS
+  uint8_t oversampling = analogScan_oversampling();
+  uint32_t sum = 0;
+  for (int i = ana; i < N_ANA_PINS * oversampling; i += N_ANA_PINS) {
+    sum += line[i];
+  }
+  return (sum + oversampling / 2) / oversampling;
 }
 
-static uint8_t readKeyboardVersion()
+void analogScan_releaseFrame()
 {
-  // hardware type 2 and 3 have digital choc keys
-  // they can be recognized because they have a resistor connecting analog pins.
-  // type 2 is a right half, and has a resistor connecting pins 28 and 29
-  // type 3 is a left half, and has a resistor connecting pins 28 and 26
-  if (detect_resistor(28, 29)) return 2;
-  if (detect_resistor(28, 26)) return 3;
+  analogScan.frameReady = false;
+}
 
-  // hardware type 0 and 1 have analog hall sensors
-  // on type 1, the right keyboard half, pin 2 is connected to pin 1;
-  // on type 0, the left half, pin 2 is connected to pin 3
-  if (detect_connection(1, 2)) return 1;
-  if (detect_connection(3, 2)) return 0;
+// when not free running, each frame must be started with analogScan_startFrame
+void analogScan_setFreeRunning(bool freeRunning)
+{
+  analogScan.freeRunning = freeRunning;
+  if (freeRunning) analogScan_startFrame();
+}
 
-  return 255;
+// starts a new frame, if scan is stopped
+void analogScan_startFrame()
+{
+  if (!analogScan.stopped) return;
+  analogScan.stopped = false;
+  // ready long before the end of the settle time
+  hw_set_bits(&adc_hw->cs, ADC_CS_EN_BITS);
+  analogScan__putMask();
 }
 
-void localReader_discoverTypeSideAndVersion(LocalReader *self)
+bool analogScan_isStopped()
 {
-  self->hw_version = readKeyboardVersion();
-  switch (self->hw_version) {
-    case 0:
-      self->kb_type = analog;
-      self->side = leftSide;
-      self->sel_pins = left_sel_pins;
-      self->hwIdToKeyId = leftAnalogHwIdToSwId;
-      comm_init(1);
-      break;
-    case 1:
-      self->kb_type = analog;
-      self->side = rightSide;
-      self->sel_pins = right_sel_pins;
-      self->hwIdToKeyId = rightAnalogHwIdToSwId;
-      comm_init(1);
-      break;
-    case 2:
-      self->kb_type = digital;
-      self->side = rightSide;
-      self->sel_pins = NULL;
-      self->hwIdToKeyId = rightDigitalHwIdToSwId;
-      comm_init(0);
-      break;
-    case 3:
-      self->kb_type = digital;
-      self->side = leftSide;
-      self->sel_pins = NULL;
-      self->hwIdToKeyId = leftDigitalHwIdToSwId;
-      comm_init(0);
-      break;
-    default:
-      self->side = noSide;
-  }
+  return analogScan.stopped;
 }
 
-void localReader_init(LocalReader *self, Controller *controller)
+// duration of the last frame with full or reduced oversampling, from its first
+//   line on to its end
+uint16_t analogScan_frame_µs(bool reduced)
 {
-  localReader_discoverTypeSideAndVersion(self);
-  if (self->side == noSide) return;
-  if (self->kb_type == analog) {
-    localReader__initAnalogGPIO(self);
-    for (int8_t hwId = 0; hwId < N_ANALOG_HWKKEYS; hwId++) {
-      int8_t keyId = self->hwIdToKeyId[hwId];
-      if (keyId != -1) {
-        Key *key = Key_keyWithId(keyId);
-        key_setMinRawRange(key, 80);
-      }
-    }
-  } else {
-    localReader__initDigitalGPIO(self);
-  }
+  return analogScan.frame_µs[reduced];
 }
 
-keyboardSide localReader_keyboardSide(LocalReader *self)
+// last reading of the temperature sensor; count is incremented at each new reading
+uint16_t analogScan_temperatureRaw(uint32_t *count)
 {
-  return self->side;
+  *count = analogScan.tempCount;
+  return analogScan.tempRaw;
 }
 
-void localReader_readDigitalKeys(LocalReader *self)
+// settle time calibration {{{2
+// for increasing settle times, frames are compared to frames taken with a
+// long settle time; the settle time of each line is the shortest one that
+// gives the same values, plus a margin.
+// keys should not move during calibration.
+
+#define SETTLE_CAL_REF_US 500
+#define SETTLE_CAL_MAX_US 100
+#define SETTLE_CAL_STEP_US 4
+#define SETTLE_CAL_FRAMES 4
+// maximum difference from reference (in ADC units) of a settled value
+#define SETTLE_CAL_TOLERANCE 4
+
+static void analogScan__waitFrame()
 {
-  uint32_t new = gpio_get_all();
-  uint8_t bit = 0;
-  uint32_t bitmask = 1;
-  while (bit < N_DIGITAL_HWKKEYS) {
-    Key *key = Key_keyWithId(self->hwIdToKeyId[bit]);
-    if (key != NULL) {
-      key_setNewDigitalRaw(key, (new & bitmask) == 0);
-    }
-    bit++;
-    bitmask <<= 1;
+  while (analogScan_frame() == NULL) {
+    tight_loop_contents();
   }
 }
 
-void localReader_readAnalogKeys(LocalReader *self)
+// sums the values of SETTLE_CAL_FRAMES frames taken with the given settle time
+static void analogScan__captureSums(uint16_t settle_µs, uint32_t sums[N_SEL_PINS][N_ANA_PINS])
 {
-  uint8_t keyId = 0;
-  for (int sel=0; sel < N_SEL_PINS; sel++) {
-    uint pin = self->sel_pins[sel];
-    gpio_put(pin, 1);
-    for (int ana=0; ana < N_ANA_PINS; ana++) {
-      adc_select_input(ana);
-      uint16_t raw = adc_read();
-      Key *key = Key_keyWithId(self->hwIdToKeyId[keyId]);
-      key_setNewAnalogRaw(key, raw);
-      keyId++;
+  for (int sel = 0; sel < N_SEL_PINS; sel++) {
+    analogScan.settle_µs[sel] = settle_µs;
+    for (int ana = 0; ana < N_ANA_PINS; ana++) {
+      sums[sel][ana] = 0;
+    }
+  }
+  // the ready frame and the one being captured may have used older settle times
+  for (int i = 0; i < 2; i++) {
+    analogScan__waitFrame();
+    analogScan_releaseFrame();
+  }
+  for (int i = 0; i < SETTLE_CAL_FRAMES; i++) {
+    analogScan__waitFrame();
+    uint16_t (*frame)[N_LINE_SAMPLES] = analogScan_frame();
+    for (int sel = 0; sel < N_SEL_PINS; sel++) {
+      for (int ana = 0; ana < N_ANA_PINS; ana++) {
+        sums[sel][ana] += analogScan_raw(frame[sel], ana);
+      }
     }
-    gpio_put(pin, 0);
-    sleep_us(50);
+    analogScan_releaseFrame();
   }
 }
-void localReader_readKeys(LocalReader *self)
+
+// must be called on the scanning core; scan is free running after the calibration
+void analogScan_calibrateSettleTimes()
 {
-  switch (self->kb_type) {
-    case analog:
-      return localReader_readAnalogKeys(self);
-    case digital:
-      return localReader_readDigitalKeys(self);
+  uint32_t ref[N_SEL_PINS][N_ANA_PINS];
+  uint32_t test[N_SEL_PINS][N_ANA_PINS];
+  uint16_t settle_µs[N_SEL_PINS];
+  uint8_t n_found = 0;
+  for (int sel = 0; sel < N_SEL_PINS; sel++) {
+    settle_µs[sel] = 0;
+  }
+  analogScan_setFreeRunning(true);
+  for (uint16_t delay = 0; delay <= SETTLE_CAL_MAX_US && n_found < N_SEL_PINS; delay += SETTLE_CAL_STEP_US) {
+    analogScan__captureSums(SETTLE_CAL_REF_US, ref);
+    analogScan__captureSums(delay, test);
+    for (int sel = 0; sel < N_SEL_PINS; sel++) {
+      if (settle_µs[sel] != 0) continue;
+      bool settled = true;
+      for (int ana = 0; ana < N_ANA_PINS; ana++) {
+        if (abs((int)test[sel][ana] - (int)ref[sel][ana]) > SETTLE_CAL_TOLERANCE * SETTLE_CAL_FRAMES) {
+          settled = false;
+        }
+      }
+      if (settled) {
+        settle_µs[sel] = delay + delay / 4 + SETTLE_CAL_STEP_US;
+        n_found++;
+      }
+    }
+  }
+  for (int sel = 0; sel < N_SEL_PINS; sel++) {
+    if (settle_µs[sel] == 0) settle_µs[sel] = SETTLE_CAL_MAX_US;
+    analogScan.settle_µs[sel] = settle_µs[sel];
   }
 }
-// }}}
-// USB callbacks {{{1
-#if 0
-//--------------------------------------------------------------------+
-// Device callbacks
-//--------------------------------------------------------------------+
 
-// Invoked when cdc when line state changed e.g connected/disconnected
-void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
+uint16_t analogScan_settleTime_µs(uint8_t sel)
 {
-	(void)itf;
-	(void)rts;
-
-	if (dtr) {
-		tud_cdc_write_str("Connected\n");
-	}
+  return analogScan.settle_µs[sel];
 }
 
-// Invoked when device is mounted
-void tud_mount_cb(void)
+// set by a command, from any core; calibration is done by the scanning core
+static volatile bool analogScan_calibrationRequested;
+
+void analogScan_requestCalibration()
 {
+  analogScan_calibrationRequested = true;
 }
 
-// Invoked when device is unmounted
-void tud_umount_cb(void)
+// calibrates if requested
+void analogScan_calibrationTask()
 {
+  if (analogScan_calibrationRequested) {
+    analogScan_calibrationRequested = false;
+    analogScan_calibrateSettleTimes();
+  }
 }
+// }}}
 
-// Invoked when usb bus is suspended
-// remote_wakeup_en : if host allow us  to perform remote wakeup
-// Within 7ms, device must draw an average of current less than 2.5 mA from bus
-void tud_suspend_cb(bool remote_wakeup_en)
+// AnalogKeys {{{1
+// state of the local analog keys, as a struct of arrays indexed by the
+// position of the key in the scan (slot), processed once per frame.
+// the conversion of a raw value to a key value uses the reciprocal of the
+// raw range of the key, recomputed only when the range changes.
+
+#define RECIPROCAL_SHIFT 16
+// tenths of travel steps in the full raw range; the top tenth of the range
+//   gives TRAVEL_MAX, so that it is reached even with a small drift
+#define TRAVEL_10 (TRAVEL_MAX * 100 / 9)
+// linearization: the position of a raw value in the raw range of the key
+//   is converted to depth by a table of LUT_N+1 points per key, with linear
+//   interpolation; positions are in 1/LUT_POS of the range
+#define LUT_N 16
+#define LUT_SEG_SHIFT 8
+#define LUT_POS (LUT_N << LUT_SEG_SHIFT)
+// bins of the histogram of positions used to build the table; a table is
+//   only accepted with enough samples, covering most of the bins
+#define LUT_BINS (LUT_N * 4)
+#define LUT_MIN_SAMPLES 500
+#define LUT_MIN_BINS ((LUT_BINS - 2) * 3 / 4)
+// a key counts as moving for this long after its filtered value changed by
+//   more than its noise; only moving keys are sampled
+#define LUT_MOVING_MS 20u
+// noise: the variance of the raw value of a released key is filtered with
+//   weight NOISE_WEIGHT; the thresholds of the key are recomputed every
+//   NOISE_UPDATE samples
+#define NOISE_WEIGHT 6
+#define NOISE_UPDATE 64
+// temperature compensation: raw values are corrected by
+//   tempCoef * (temperature - TEMP_REF_CC) before filtering; tempCoef is in
+//   raw units per degree, times 256 (it is the slope of the raw value of the
+//   released key versus temperature, as shown by log_keys)
+#define TEMP_REF_CC 2500
+// crosstalk: the neighbours of a key are the other keys on its selector line
+//   and on its analog line; raw values are corrected by the neighbours'
+//   deviations from rest, times a coefficient (in 1/4096) per neighbour
+#define N_NEIGHBOURS (N_ANA_PINS - 1 + N_SEL_PINS - 1)
+#define CROSSTALK_SHIFT 12
+// minimum frames with a key pressed alone to compute its effect on its neighbours
+#define CROSSTALK_MIN_FRAMES 50
+
+static struct analogKeys {
+  uint8_t n;
+  // the key in each slot
+  uint8_t hwId[N_ANALOG_HWKKEYS];
+  Key *key[N_ANALOG_HWKKEYS];
+  int8_t slotOfKeyId[N_KEYS];
+  int8_t slotOfHwId[N_ANALOG_HWKKEYS];
+  // last value read from sensor
+  uint16_t raw[N_ANALOG_HWKKEYS];
+  // scaled values, for filtering
+  uint32_t filteredRaw_S[N_ANALOG_HWKKEYS];
+  uint32_t minRaw_S[N_ANALOG_HWKKEYS];
+  uint32_t maxRaw_S[N_ANALOG_HWKKEYS];
+  // unscaled limits, and (LUT_POS << RECIPROCAL_SHIFT) / (maxRaw - minRaw);
+  //   reciprocal is 0 while the range is smaller than minRawRange
+  uint16_t minRaw[N_ANALOG_HWKKEYS];
+  uint16_t maxRaw[N_ANALOG_HWKKEYS];
+  uint16_t minRawRange[N_ANALOG_HWKKEYS];
+  uint32_t reciprocal[N_ANALOG_HWKKEYS];
+  // last value sent by the scanner
+  uint8_t scannedVal[N_ANALOG_HWKKEYS];
+  // early press detection: last filtered value (tenths of steps), value
+  //   when the key started rising, frames rising and early press sent
+  int16_t lastFiltered10[N_ANALOG_HWKKEYS];
+  int16_t riseStart10[N_ANALOG_HWKKEYS];
+  uint8_t risingFrames[N_ANALOG_HWKKEYS];
+  bool earlySent[N_ANALOG_HWKKEYS];
+  // temperature compensation coefficient and its current correction
+  int16_t tempCoef[N_ANALOG_HWKKEYS];
+  int16_t tempOffset[N_ANALOG_HWKKEYS];
+  volatile bool tempCoefChanged; // set from core0, cleared by the scanning core
+  uint32_t tempCount;
+  uint32_t temp_S;              // filtered temperature sensor reading
+  volatile int16_t temperature_cC;
+  // noise at rest: variance of raw values (times 256), samples since last
+  //   update, and thresholds derived from it (tenths of travel steps)
+  uint32_t noiseVar_S[N_ANALOG_HWKKEYS];
+  uint8_t noiseSamples[N_ANALOG_HWKKEYS];
+  uint16_t hysteresis10[N_ANALOG_HWKKEYS];
+  uint16_t earlyVelocity10[N_ANALOG_HWKKEYS];
+  // health: since when at a rail (0 if not), since when raw is stuckRaw,
+  //   key was calibrated, key is faulty (not reported; cleared from the
+  //   other core) and why
+  uint32_t railSince_µs[N_ANALOG_HWKKEYS];
+  uint32_t stuckSince_µs[N_ANALOG_HWKKEYS];
+  uint16_t stuckRaw[N_ANALOG_HWKKEYS];
+  bool wasCalibrated[N_ANALOG_HWKKEYS];
+  volatile bool faulty[N_ANALOG_HWKKEYS];
+  volatile uint8_t fault[N_ANALOG_HWKKEYS];
+  // depth (in 1/255 of full travel) at each table point, and the same in
+  //   tenths of travel steps
+  uint8_t lut[N_ANALOG_HWKKEYS][LUT_N + 1];
+  uint16_t lut10[N_ANALOG_HWKKEYS][LUT_N + 1];
+  // linearization sweep: histograms of positions of each key, and keys
+  //   calibrated by the last sweep
+  volatile bool lutCalRequested;
+  volatile bool lutCal;
+  volatile uint8_t lutCalKeys;
+  uint32_t lutCalStart_µs;
+  uint16_t histogram[N_ANALOG_HWKKEYS][LUT_BINS];
+  // filtered value when the key last moved, and when that was
+  uint16_t lutLastRaw[N_ANALOG_HWKKEYS];
+  uint32_t lutMoved_µs[N_ANALOG_HWKKEYS];
+  // neighbour slots (-1 if no key there) and crosstalk coefficients
+  int8_t neighbour[N_ANALOG_HWKKEYS][N_NEIGHBOURS];
+  int16_t crosstalk[N_ANALOG_HWKKEYS][N_NEIGHBOURS];
+  // crosstalk calibration: frames and sums for each key pressed alone, and
+  //   keys calibrated by the last one
+  volatile bool crosstalkCalRequested;
+  volatile bool crosstalkCal;
+  volatile uint8_t crosstalkCalKeys;
+  uint32_t crosstalkCalStart_µs;
+  uint16_t calFrames[N_ANALOG_HWKKEYS];
+  int64_t calSumPP[N_ANALOG_HWKKEYS];
+  int64_t calSumPN[N_ANALOG_HWKKEYS][N_NEIGHBOURS];
+  // processor cycles used by the last frame
+  volatile uint32_t frameCycles;
+} analogKeys;
+
+void analogKeys_init()
+{
+  memset(&analogKeys, 0, sizeof(analogKeys));
+  for (int keyId = 0; keyId < N_KEYS; keyId++) {
+    analogKeys.slotOfKeyId[keyId] = -1;
+  }
+  for (int hwId = 0; hwId < N_ANALOG_HWKKEYS; hwId++) {
+    analogKeys.slotOfHwId[hwId] = -1;
+  }
+}
+
+static void analogKeys__setLutPoint(int slot, int i, uint8_t depth)
 {
-  (void) remote_wakeup_en;
+  analogKeys.lut[slot][i] = depth;
+  analogKeys.lut10[slot][i] = depth * TRAVEL_10 / 255;
+}
+
+void analogKeys_addKey(uint8_t hwId, uint8_t keyId, uint16_t minRawRange)
+{
+  uint8_t slot = analogKeys.n++;
+  analogKeys.hwId[slot] = hwId;
+  analogKeys.key[slot] = Key_keyWithId(keyId);
+  analogKeys.slotOfKeyId[keyId] = slot;
+  analogKeys.slotOfHwId[hwId] = slot;
+  analogKeys.filteredRaw_S[slot] = UINT32_MAX;
+  analogKeys.minRawRange[slot] = minRawRange;
+  analogKeys.noiseVar_S[slot] = UINT32_MAX;
+  analogKeys.hysteresis10[slot] = TRAVEL_HYSTERESIS;
+  analogKeys.earlyVelocity10[slot] = EARLY_PRESS_VELOCITY;
+  // linear until calibrated
+  for (int i = 0; i <= LUT_N; i++) {
+    analogKeys__setLutPoint(slot, i, i * 255 / LUT_N);
+  }
+}
+
+// neighbour k of a key: first the other keys on its selector line, then the
+//   other keys on its analog line, both in circular order from the key.
+//   if n is neighbour k of h, h is neighbour analogKeys__reverse(k) of n
+static uint8_t analogKeys__neighbourHwId(uint8_t hwId, int k)
+{
+  int sel = hwId / N_ANA_PINS;
+  int ana = hwId % N_ANA_PINS;
+  if (k < N_ANA_PINS - 1) {
+    ana = (ana + 1 + k) % N_ANA_PINS;
+  } else {
+    sel = (sel + 1 + k - (N_ANA_PINS - 1)) % N_SEL_PINS;
+  }
+  return sel * N_ANA_PINS + ana;
+}
+static int analogKeys__reverse(int k)
+{
+  if (k < N_ANA_PINS - 1) return N_ANA_PINS - 2 - k;
+  return (N_ANA_PINS - 1) + (N_SEL_PINS - 2 - (k - (N_ANA_PINS - 1)));
+}
+
+// must be called after all keys are added
+void analogKeys_linkNeighbours()
+{
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    for (int k = 0; k < N_NEIGHBOURS; k++) {
+      uint8_t hwId = analogKeys__neighbourHwId(analogKeys.hwId[slot], k);
+      analogKeys.neighbour[slot][k] = analogKeys.slotOfHwId[hwId];
+    }
+  }
+}
+
+// crosstalk coefficient of neighbour k of the key at hwId (for CalStore)
+int16_t analogKeys_crosstalk(uint8_t hwId, int k)
+{
+  int8_t slot = analogKeys.slotOfHwId[hwId];
+  return slot == -1 ? 0 : analogKeys.crosstalk[slot][k];
+}
+
+void analogKeys_setCrosstalk(uint8_t hwId, int k, int16_t coef)
+{
+  int8_t slot = analogKeys.slotOfHwId[hwId];
+  if (slot != -1) analogKeys.crosstalk[slot][k] = coef;
+}
+
+// linearization table point i of the key at hwId (for CalStore)
+uint8_t analogKeys_lutPoint(uint8_t hwId, int i)
+{
+  int8_t slot = analogKeys.slotOfHwId[hwId];
+  return slot == -1 ? i * 255 / LUT_N : analogKeys.lut[slot][i];
+}
+
+// sets a whole table; ignored if it does not go from 0 to 255 without decreasing
+void analogKeys_setLut(uint8_t hwId, const uint8_t lut[LUT_N + 1])
+{
+  int8_t slot = analogKeys.slotOfHwId[hwId];
+  if (slot == -1 || lut[0] != 0 || lut[LUT_N] != 255) return;
+  for (int i = 0; i < LUT_N; i++) {
+    if (lut[i + 1] < lut[i]) return;
+  }
+  for (int i = 0; i <= LUT_N; i++) {
+    analogKeys__setLutPoint(slot, i, lut[i]);
+  }
+}
+
+// set by a command, from any core; calibration is done by the scanning core
+void analogKeys_requestCrosstalkCalibration()
+{
+  analogKeys.crosstalkCalRequested = true;
+}
+
+void analogKeys_requestLutCalibration()
+{
+  analogKeys.lutCalRequested = true;
+}
+
+// sets limits learned before (restored from flash); they are kept only
+// if the first reading of the key is close to the released limit
+void analogKeys_setLimits(uint8_t keyId, uint16_t minRaw, uint16_t maxRaw)
+{
+  int8_t slot = analogKeys.slotOfKeyId[keyId];
+  if (slot == -1 || maxRaw <= minRaw) return;
+  analogKeys.minRaw_S[slot] = minRaw << 13;
+  analogKeys.maxRaw_S[slot] = maxRaw << 13;
+}
+
+// sets the temperature coefficient of a key (raw units per degree, times 256);
+//   returns false if it is not a local analog key
+bool analogKeys_setTempCoef(uint8_t keyId, int16_t coef)
+{
+  int8_t slot = analogKeys.slotOfKeyId[keyId];
+  if (slot == -1) return false;
+  analogKeys.tempCoef[slot] = coef;
+  __dmb(); // the coefficient must be visible before the flag
+  analogKeys.tempCoefChanged = true; // the scanning core recomputes the corrections
+  return true;
+}
+
+int16_t analogKeys_tempCoef(uint8_t keyId)
+{
+  int8_t slot = analogKeys.slotOfKeyId[keyId];
+  return slot == -1 ? 0 : analogKeys.tempCoef[slot];
+}
+
+// temperature in hundredths of degree
+int16_t analogKeys_temperature_cC()
+{
+  return analogKeys.temperature_cC;
+}
+
+// slot of the key with the given id, -1 if not a local analog key
+int8_t analogKeys_slot(uint8_t keyId)
+{
+  return analogKeys.slotOfKeyId[keyId];
+}
+
+static void filter_SS(uint32_t *old_S, uint32_t new_S, uint8_t weight)
+{
+  *old_S = *old_S + (new_S >> weight) - (*old_S >> weight);
+}
+static void filter_SnS(uint32_t *old_S, uint16_t new, uint8_t scale, uint8_t weight)
+{
+  filter_SS(old_S, ((uint32_t)new) << scale, weight);
+}
+// restored limits fit the first reading if the key seems released
+//   (a moved magnet or a key pressed at boot make the key learn its limits again)
+static bool analogKeys__limitsFit(int slot)
+{
+  int minRaw = analogKeys.minRaw_S[slot] >> 13;
+  int maxRaw = analogKeys.maxRaw_S[slot] >> 13;
+  int raw = analogKeys.raw[slot];
+  if (maxRaw <= minRaw) return false;
+  return raw >= minRaw - CAL_RESTORE_TOLERANCE
+      && raw <= minRaw + MIN(CAL_RESTORE_TOLERANCE, (maxRaw - minRaw) / 4);
+}
+
+static inline void analogKeys__filterRawValue(int slot)
+{
+  uint32_t *filteredRaw_S = &analogKeys.filteredRaw_S[slot];
+  uint32_t *minRaw_S = &analogKeys.minRaw_S[slot];
+  uint32_t *maxRaw_S = &analogKeys.maxRaw_S[slot];
+  if (*filteredRaw_S == UINT32_MAX) {
+    // if it's the first value, initialize
+    *filteredRaw_S = analogKeys.raw[slot] << 13;
+    if (!analogKeys__limitsFit(slot)) {
+      *maxRaw_S = *filteredRaw_S;
+      *minRaw_S = *filteredRaw_S;
+    }
+    return;
+  }
+  filter_SnS(filteredRaw_S, analogKeys.raw[slot], 13, RAW_FILTER_WEIGHT);
+  // if value is outside of max or min limits, fast drift min or max to value
+  if (*filteredRaw_S < *minRaw_S) {
+    filter_SS(minRaw_S, *filteredRaw_S, 1);
+  } else if (*filteredRaw_S > *maxRaw_S) {
+    filter_SS(maxRaw_S, *filteredRaw_S, 1);
+  } else {
+    // if value is close to max or min, slowly drift min or max to value
+    uint32_t dist = (*maxRaw_S - *minRaw_S) / 3;
+    if ((*filteredRaw_S - *minRaw_S) < dist) {
+      filter_SS(minRaw_S, *filteredRaw_S, 13);
+    } else if ((*maxRaw_S - *filteredRaw_S) < dist) {
+      filter_SS(maxRaw_S, *filteredRaw_S, 13);
+    }
+  }
+}
+
+// the only division, done when the limits of a key change
+static void analogKeys__updateRange(int slot)
+{
+  uint16_t minRaw = analogKeys.minRaw_S[slot] >> 13;
+  uint16_t maxRaw = analogKeys.maxRaw_S[slot] >> 13;
+  if (minRaw == analogKeys.minRaw[slot] && maxRaw == analogKeys.maxRaw[slot]) return;
+  analogKeys.minRaw[slot] = minRaw;
+  analogKeys.maxRaw[slot] = maxRaw;
+  int rawRange = maxRaw - minRaw;
+  if (rawRange < analogKeys.minRawRange[slot]) {
+    analogKeys.reciprocal[slot] = 0;
+  } else {
+    analogKeys.reciprocal[slot] = ((uint32_t)LUT_POS << RECIPROCAL_SHIFT) / rawRange;
+  }
+}
+
+// position of a raw reading in the raw range of the key, 0 to LUT_POS
+static inline int analogKeys__position(int slot, int raw)
+{
+  int dist = raw - analogKeys.minRaw[slot];
+  if (dist <= 0) return 0;
+  // limits the product to LUT_POS << RECIPROCAL_SHIFT
+  int rawRange = analogKeys.maxRaw[slot] - analogKeys.minRaw[slot];
+  if (dist > rawRange) dist = rawRange;
+  return (dist * analogKeys.reciprocal[slot]) >> RECIPROCAL_SHIFT;
+}
+
+static inline int analogKeys__val10(int slot, int raw)
+{
+  int pos = analogKeys__position(slot, raw);
+  int i = pos >> LUT_SEG_SHIFT;
+  int val_10 = analogKeys.lut10[slot][i];
+  if (i < LUT_N) {
+    int f = pos & ((1 << LUT_SEG_SHIFT) - 1);
+    val_10 += ((analogKeys.lut10[slot][i + 1] - val_10) * f) >> LUT_SEG_SHIFT;
+  }
+  return val_10 > TRAVEL_MAX * 10 ? TRAVEL_MAX * 10 : val_10;
+}
+
+// tracks the velocity of the filtered value of the key; returns true when
+//   the key commits to a press (rising fast for some frames, by a minimum amount)
+static bool analogKeys__detectEarlyPress(int slot)
+{
+  int val10 = analogKeys__val10(slot, analogKeys.filteredRaw_S[slot] >> 13);
+  int vel = val10 - analogKeys.lastFiltered10[slot];
+  analogKeys.lastFiltered10[slot] = val10;
+  int minVel = analogKeys.earlyVelocity10[slot];
+  if (vel >= minVel) {
+    if (analogKeys.risingFrames[slot] == 0) analogKeys.riseStart10[slot] = val10 - vel;
+    if (analogKeys.risingFrames[slot] < UINT8_MAX) analogKeys.risingFrames[slot]++;
+  } else {
+    analogKeys.risingFrames[slot] = 0;
+    // moving up again: a new early press can be detected
+    if (vel <= -minVel) analogKeys.earlySent[slot] = false;
+    return false;
+  }
+  if (analogKeys.earlySent[slot]) return false;
+  if (analogKeys.risingFrames[slot] < EARLY_PRESS_FRAMES) return false;
+  if (val10 - analogKeys.riseStart10[slot] < EARLY_PRESS_MIN_RISE * 10) return false;
+  analogKeys.earlySent[slot] = true;
+  return true;
+}
+
+// recomputes the corrections of the keys for the current temperature
+static void analogKeys__updateTempOffsets()
+{
+  if (analogKeys.temp_S == 0) return; // no reading yet
+  int16_t cC = analogKeys.temperature_cC;
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    analogKeys.tempOffset[slot] = analogKeys.tempCoef[slot] * (cC - TEMP_REF_CC) / (256 * 100);
+  }
+}
+
+// filters a new temperature reading and recomputes the corrections of the keys
+static void analogKeys__updateTemperature(uint16_t tempRaw)
+{
+  if (analogKeys.temp_S == 0) analogKeys.temp_S = tempRaw << 8;
+  filter_SnS(&analogKeys.temp_S, tempRaw, 8, 3);
+  // sensor gives 706mV at 27C, -1.721mV/C; ADC reference is 3.3V
+  int32_t µV = (int32_t)((analogKeys.temp_S * 3300000ull) >> (12 + 8));
+  int16_t cC = 2700 - (µV - 706000) * 100 / 1721;
+  analogKeys.temperature_cC = cC;
+  analogKeys__updateTempOffsets();
+}
+
+// deviation of the key from rest, in the direction of a press
+static inline int analogKeys__deviation(int slot)
+{
+  int dev = analogKeys.raw[slot] - analogKeys.minRaw[slot];
+  return dev < 0 ? 0 : dev;
+}
+
+// removes from each raw value the effect of its neighbours
+static void analogKeys__removeCrosstalk()
+{
+  int dev[N_ANALOG_HWKKEYS];
+  int n = analogKeys.n;
+  for (int slot = 0; slot < n; slot++) {
+    dev[slot] = analogKeys__deviation(slot);
+  }
+  for (int slot = 0; slot < n; slot++) {
+    int32_t sum = 0;
+    for (int k = 0; k < N_NEIGHBOURS; k++) {
+      int8_t nb = analogKeys.neighbour[slot][k];
+      if (nb != -1) sum += analogKeys.crosstalk[slot][k] * dev[nb];
+    }
+    int raw = analogKeys.raw[slot] - (sum >> CROSSTALK_SHIFT);
+    analogKeys.raw[slot] = raw < 0 ? 0 : raw > 4095 ? 4095 : raw;
+  }
+}
+
+// crosstalk calibration: while a key is pressed alone (deviation above a
+//   quarter of its range, all others below), its deviation and the
+//   deviations of its neighbours are accumulated; the coefficient of the
+//   key on each neighbour is the least squares slope of these.
+//   keys are not reported during calibration.
+static void analogKeys__startCrosstalkCal()
+{
+  analogKeys.crosstalkCal = true;
+  analogKeys.crosstalkCalStart_µs = time_us_32();
+  memset(analogKeys.calFrames, 0, sizeof(analogKeys.calFrames));
+  memset(analogKeys.calSumPP, 0, sizeof(analogKeys.calSumPP));
+  memset(analogKeys.calSumPN, 0, sizeof(analogKeys.calSumPN));
+}
+
+static void analogKeys__accumulateCrosstalk()
+{
+  int pressed = -1;
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    int range = analogKeys.maxRaw[slot] - analogKeys.minRaw[slot];
+    if (analogKeys.reciprocal[slot] == 0) continue;
+    if (analogKeys__deviation(slot) > range / 4) {
+      if (pressed != -1) return; // more than one key pressed
+      pressed = slot;
+    }
+  }
+  if (pressed == -1) return;
+  int devP = analogKeys__deviation(pressed);
+  if (analogKeys.calFrames[pressed] < UINT16_MAX) analogKeys.calFrames[pressed]++;
+  analogKeys.calSumPP[pressed] += devP * devP;
+  for (int k = 0; k < N_NEIGHBOURS; k++) {
+    int8_t nb = analogKeys.neighbour[pressed][k];
+    if (nb == -1) continue;
+    // signed: a neighbour may move either way
+    int devN = analogKeys.raw[nb] - analogKeys.minRaw[nb];
+    analogKeys.calSumPN[pressed][k] += devP * devN;
+  }
+}
+
+static void analogKeys__finishCrosstalkCal()
+{
+  int n_keys = 0;
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    if (analogKeys.calFrames[slot] < CROSSTALK_MIN_FRAMES) continue;
+    // a key that never left its rest value tells nothing about its neighbours
+    if (analogKeys.calSumPP[slot] == 0) continue;
+    n_keys++;
+    for (int k = 0; k < N_NEIGHBOURS; k++) {
+      int8_t nb = analogKeys.neighbour[slot][k];
+      if (nb == -1) continue;
+      int64_t coef = analogKeys.calSumPN[slot][k] * (1 << CROSSTALK_SHIFT) / analogKeys.calSumPP[slot];
+      coef = coef < INT16_MIN ? INT16_MIN : coef > INT16_MAX ? INT16_MAX : coef;
+      // effect of slot on nb is corrected at nb, where slot is the reverse neighbour
+      analogKeys.crosstalk[nb][analogKeys__reverse(k)] = coef;
+    }
+  }
+  analogKeys.crosstalkCalKeys = n_keys;
+  __dmb(); // result must be visible before the end of the calibration
+  analogKeys.crosstalkCal = false;
+  if (n_keys > 0) calStore_requestSave();
+}
+
+static void analogKeys__crosstalkCalTask()
+{
+  if (analogKeys.crosstalkCalRequested) {
+    analogKeys.crosstalkCalRequested = false;
+    analogKeys__startCrosstalkCal();
+  }
+  if (!analogKeys.crosstalkCal) return;
+  if (time_us_32() - analogKeys.crosstalkCalStart_µs > CROSSTALK_CAL_MS * 1000) {
+    analogKeys__finishCrosstalkCal();
+  } else {
+    analogKeys__accumulateCrosstalk();
+  }
+}
+
+// linearization sweep: each key should be pressed slowly, at a constant
+//   speed, through its whole travel, a few times. the time spent at each
+//   position is then proportional to the depth it covers, so the cumulative
+//   histogram of positions gives the depth at each position.
+//   the first and last bins are not counted (key at rest and bottomed out);
+//   their depth is taken from their neighbours. a key that is not moving is
+//   not counted either, or a key resting a bit above its minimum would fill
+//   a bin. keys are not reported.
+static void analogKeys__startLutCal()
+{
+  uint32_t now = time_us_32();
+  analogKeys.lutCal = true;
+  analogKeys.lutCalStart_µs = now;
+  memset(analogKeys.histogram, 0, sizeof(analogKeys.histogram));
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    analogKeys.lutLastRaw[slot] = analogKeys.filteredRaw_S[slot] >> 13;
+    analogKeys.lutMoved_µs[slot] = now - LUT_MOVING_MS * 1000;
+  }
+}
+
+static void analogKeys__accumulateLut()
+{
+  uint32_t now = time_us_32();
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    if (analogKeys.reciprocal[slot] == 0) continue;
+    uint16_t raw = analogKeys.filteredRaw_S[slot] >> 13;
+    int noise10 = MAX(analogKeys_noise10(slot), 10);
+    if (abs(raw - analogKeys.lutLastRaw[slot]) * 10 > noise10) {
+      analogKeys.lutLastRaw[slot] = raw;
+      analogKeys.lutMoved_µs[slot] = now;
+    }
+    if (now - analogKeys.lutMoved_µs[slot] >= LUT_MOVING_MS * 1000) continue;
+    int bin = analogKeys__position(slot, raw) * LUT_BINS / (LUT_POS + 1);
+    if (bin == 0 || bin == LUT_BINS - 1) continue;
+    if (analogKeys.histogram[slot][bin] < UINT16_MAX) analogKeys.histogram[slot][bin]++;
+  }
+}
+
+static void analogKeys__finishLutCal()
+{
+  int n_keys = 0;
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    uint16_t *h = analogKeys.histogram[slot];
+    h[0] = h[1];
+    h[LUT_BINS - 1] = h[LUT_BINS - 2];
+    uint32_t total = 0;
+    int covered = 0;
+    for (int b = 0; b < LUT_BINS; b++) {
+      total += h[b];
+      if (b != 0 && b != LUT_BINS - 1 && h[b] != 0) covered++;
+    }
+    if (total < LUT_MIN_SAMPLES || covered < LUT_MIN_BINS) continue;
+    n_keys++;
+    uint32_t sum = 0;
+    for (int i = 0; i <= LUT_N; i++) {
+      analogKeys__setLutPoint(slot, i, sum * 255 / total);
+      for (int b = i * (LUT_BINS / LUT_N); b < (i + 1) * (LUT_BINS / LUT_N) && b < LUT_BINS; b++) {
+        sum += h[b];
+      }
+    }
+  }
+  analogKeys.lutCalKeys = n_keys;
+  __dmb(); // result must be visible before the end of the sweep
+  analogKeys.lutCal = false;
+  if (n_keys > 0) calStore_requestSave();
+}
+
+static void analogKeys__lutCalTask()
+{
+  if (analogKeys.lutCalRequested) {
+    analogKeys.lutCalRequested = false;
+    analogKeys__startLutCal();
+  }
+  if (!analogKeys.lutCal) return;
+  if (time_us_32() - analogKeys.lutCalStart_µs > LUT_CAL_MS * 1000) {
+    analogKeys__finishLutCal();
+  } else {
+    analogKeys__accumulateLut();
+  }
+}
+
+static uint32_t isqrt(uint32_t x)
+{
+  uint32_t r = 0;
+  for (uint32_t bit = 1u << 30; bit != 0; bit >>= 2) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+  }
+  return r;
+}
+
+// noise of the key at rest, in tenths of raw units
+uint16_t analogKeys_noise10(int slot)
+{
+  if (analogKeys.noiseVar_S[slot] == UINT32_MAX) return 0;
+  return isqrt(analogKeys.noiseVar_S[slot]) * 10 / 16;
+}
+
+// derives the thresholds of the key from its noise
+static void analogKeys__updateThresholds(int slot)
+{
+  int rawRange = analogKeys.maxRaw[slot] - analogKeys.minRaw[slot];
+  if (rawRange <= 0) return;
+  // sigma in raw units times 16, then in tenths of travel steps
+  uint32_t sigma16 = isqrt(analogKeys.noiseVar_S[slot]);
+  int sigma10 = sigma16 * TRAVEL_10 / rawRange / 16;
+  int hysteresis = NOISE_SIGMAS * sigma10;
+  if (hysteresis < TRAVEL_HYSTERESIS_MIN) hysteresis = TRAVEL_HYSTERESIS_MIN;
+  if (hysteresis > 4 * TRAVEL_HYSTERESIS) hysteresis = 4 * TRAVEL_HYSTERESIS;
+  analogKeys.hysteresis10[slot] = hysteresis;
+  analogKeys.earlyVelocity10[slot] = MAX(EARLY_PRESS_VELOCITY, 2 * sigma10);
+}
+
+// filters the variance of the raw value while the key is released and still;
+//   must be called before the new value is filtered
+static inline void analogKeys__trackNoise(int slot)
+{
+  if (analogKeys.scannedVal[slot] != 0 || analogKeys.filteredRaw_S[slot] == UINT32_MAX) return;
+  int d = analogKeys.raw[slot] - (int)(analogKeys.filteredRaw_S[slot] >> 13);
+  if (abs(d) > MOVEMENT_RAW_DELTA) return;
+  uint32_t d2_S = (uint32_t)(d * d) << 8;
+  if (analogKeys.noiseVar_S[slot] == UINT32_MAX) {
+    analogKeys.noiseVar_S[slot] = d2_S;
+  } else {
+    filter_SS(&analogKeys.noiseVar_S[slot], d2_S, NOISE_WEIGHT);
+  }
+  if (++analogKeys.noiseSamples[slot] == NOISE_UPDATE) {
+    analogKeys.noiseSamples[slot] = 0;
+    analogKeys__updateThresholds(slot);
+  }
+}
+
+// why the sensor of a key is faulty
+enum { fault_none, fault_rail, fault_stuck, fault_range };
+static char *analogKeys__faultName[] = { "", "at rail", "stuck", "range collapsed" };
+
+// true if the sensor of the key seems broken
+//   (times are checked, not frames, as the frame rate changes with activity)
+static bool analogKeys__checkHealth(int slot, uint32_t now)
+{
+  uint16_t raw = analogKeys.raw[slot];
+  uint8_t fault = fault_none;
+  if (raw <= HEALTH_RAIL_RAW || raw >= 4095 - HEALTH_RAIL_RAW) {
+    if (analogKeys.railSince_µs[slot] == 0) {
+      analogKeys.railSince_µs[slot] = now ? now : 1;
+    } else if (now - analogKeys.railSince_µs[slot] > HEALTH_STUCK_MS * 1000) {
+      fault = fault_rail;
+    }
+  } else {
+    analogKeys.railSince_µs[slot] = 0;
+  }
+  // a working sensor is never free of noise, but averaged readings of a quiet
+  //   one can repeat for long: a flat value is only stuck if no noise is seen
+  if (abs(raw - analogKeys.stuckRaw[slot]) > 1) {
+    analogKeys.stuckRaw[slot] = raw;
+    analogKeys.stuckSince_µs[slot] = now;
+  } else if (now - analogKeys.stuckSince_µs[slot] > HEALTH_STUCK_MS * 1000
+             && analogKeys.noiseVar_S[slot] < HEALTH_STUCK_NOISE_S) {
+    fault = fault_stuck;
+  }
+  if (analogKeys.reciprocal[slot] != 0) {
+    analogKeys.wasCalibrated[slot] = true;
+  } else if (analogKeys.wasCalibrated[slot]
+             && analogKeys.maxRaw[slot] - analogKeys.minRaw[slot] < analogKeys.minRawRange[slot] / 2) {
+    fault = fault_range;
+  }
+  if (fault == fault_none) return false;
+  analogKeys.fault[slot] = fault;
+  __dmb(); // the reason must be visible before the fault
+  analogKeys.railSince_µs[slot] = 0;
+  analogKeys.stuckSince_µs[slot] = now;
+  analogKeys.wasCalibrated[slot] = false;
+  return true;
+}
+
+bool analogKeys_isFaulty(uint8_t keyId)
+{
+  int8_t slot = analogKeys.slotOfKeyId[keyId];
+  return slot != -1 && analogKeys.faulty[slot];
+}
+
+void analogKeys_clearFault(uint8_t keyId)
+{
+  int8_t slot = analogKeys.slotOfKeyId[keyId];
+  if (slot != -1) analogKeys.faulty[slot] = false;
+}
+
+// while calibrating, keys are not reported
+static inline bool analogKeys__calibrating()
+{
+  return analogKeys.crosstalkCal || analogKeys.lutCal;
+}
+
+// processes a frame from AnalogScan; returns true if some key seems to be moving
+bool analogKeys_processFrame(uint16_t (*frame)[N_LINE_SAMPLES])
+{
+  uint32_t start = systick_hw->cvr;
+  uint32_t now = time_us_32();
+  bool moved = false;
+  int n = analogKeys.n;
+  uint32_t tempCount;
+  uint16_t tempRaw = analogScan_temperatureRaw(&tempCount);
+  if (tempCount != analogKeys.tempCount) {
+    analogKeys.tempCount = tempCount;
+    analogKeys__updateTemperature(tempRaw);
+  }
+  if (analogKeys.tempCoefChanged) {
+    analogKeys.tempCoefChanged = false;
+    __dmb(); // read the coefficients only after clearing the flag
+    analogKeys__updateTempOffsets();
+  }
+  for (int slot = 0; slot < n; slot++) {
+    uint8_t hwId = analogKeys.hwId[slot];
+    int raw = analogScan_raw(frame[hwId / N_ANA_PINS], hwId % N_ANA_PINS);
+    raw -= analogKeys.tempOffset[slot];
+    analogKeys.raw[slot] = raw < 0 ? 0 : raw;
+  }
+  analogKeys__crosstalkCalTask();
+  // calibration measures the uncorrected values
+  if (!analogKeys.crosstalkCal) analogKeys__removeCrosstalk();
+  for (int slot = 0; slot < n; slot++) {
+    uint16_t newRaw = analogKeys.raw[slot];
+    if (analogKeys.filteredRaw_S[slot] != UINT32_MAX
+        && abs(newRaw - (int)(analogKeys.filteredRaw_S[slot] >> 13)) > MOVEMENT_RAW_DELTA) {
+      moved = true;
+    }
+    // reduced frames are noisier than the ones thresholds are used with
+    if (analogScan_oversampling() == ADC_OVERSAMPLING) analogKeys__trackNoise(slot);
+    analogKeys__filterRawValue(slot);
+    analogKeys__updateRange(slot);
+    if (!analogKeys.faulty[slot] && analogKeys__checkHealth(slot, now)) analogKeys.faulty[slot] = true;
+    if (analogKeys.faulty[slot]) {
+      // releases the key, then stops reporting it
+      if (analogKeys.scannedVal[slot] != 0
+          && key__publishVal(analogKeys.key[slot], 0, false)) analogKeys.scannedVal[slot] = 0;
+      continue;
+    }
+    if (analogKeys.reciprocal[slot] == 0 || analogKeys__calibrating()) continue;
+    int old_val_10 = analogKeys.scannedVal[slot] * 10;
+    int new_val_10 = analogKeys__val10(slot, newRaw);
+    int hysteresis = analogKeys.hysteresis10[slot];
+    if (new_val_10 < hysteresis) new_val_10 = 0; // noise at rest
+    bool early = EARLY_PRESS && analogKeys__detectEarlyPress(slot);
+    if (early || abs(new_val_10 - old_val_10) > hysteresis) {
+      uint8_t newVal = (new_val_10 + 5) / 10;
+      if (key__publishVal(analogKeys.key[slot], newVal, early)) {
+        analogKeys.scannedVal[slot] = newVal;
+      } else if (early) {
+        analogKeys.earlySent[slot] = false; // try again in next frame
+      }
+      moved = true;
+    }
+  }
+  analogKeys__lutCalTask();
+  // systick counts down, 24 bits
+  analogKeys.frameCycles = (start - systick_hw->cvr) & 0xffffff;
+  return moved;
+}
+
+// starts the counter of processor cycles on the current core
+void analogKeys_startCycleCounter()
+{
+  systick_hw->rvr = 0xffffff;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5; // enabled, processor clock, no interrupt
+}
+
+uint32_t analogKeys_frameCycles()
+{
+  return analogKeys.frameCycles;
+}
+
+// prints what the scanning core did; runs on core0, as the scanning core
+//   must not use stdio or tinyUSB
+void analogKeys_reportTask()
+{
+  static bool crosstalkCal = false;
+  if (analogKeys.crosstalkCal != crosstalkCal) {
+    crosstalkCal = !crosstalkCal;
+    if (crosstalkCal) {
+      printf("crosstalk calibration: press each key alone, a few times\n");
+    } else {
+      __dmb(); // read the result only after seeing the end
+      printf("crosstalk calibration done: %d of %d keys\n", analogKeys.crosstalkCalKeys, analogKeys.n);
+    }
+  }
+  static bool lutCal = false;
+  if (analogKeys.lutCal != lutCal) {
+    lutCal = !lutCal;
+    if (lutCal) {
+      printf("linearization: press each key slowly through its travel, a few times\n");
+    } else {
+      __dmb(); // read the result only after seeing the end
+      printf("linearization done: %d of %d keys\n", analogKeys.lutCalKeys, analogKeys.n);
+    }
+  }
+  static bool reported[N_ANALOG_HWKKEYS];
+  for (int slot = 0; slot < analogKeys.n; slot++) {
+    if (analogKeys.faulty[slot] == reported[slot]) continue;
+    reported[slot] = !reported[slot];
+    if (reported[slot]) {
+      __dmb(); // read the reason only after seeing the fault
+      log(LOG_E, "k%d quarantined: %s", key_id(analogKeys.key[slot]),
+          analogKeys__faultName[analogKeys.fault[slot]]);
+    }
+  }
+}
+
+// CalStore {{{1
+// keeps the calibration of the analog keys in the last sector of flash.
+// each save writes a record to the next free place of the sector; the
+// sector is erased only when full. the last valid record is used at boot.
+// flash can't be read while being written: the other core is locked out,
+// and interrupts are disabled.
+
+#define CAL_STORE_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define CAL_RECORD_SIZE (4 * FLASH_PAGE_SIZE)
+#define CAL_STORE_N_RECORDS (FLASH_SECTOR_SIZE / CAL_RECORD_SIZE)
+#define CAL_STORE_MAGIC 0x4b43414fu // changes when CalRecord changes
+
+typedef union {
+  struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint8_t hw_version;
+    uint16_t minRaw[N_KEYS];
+    uint16_t maxRaw[N_KEYS];
+    int16_t tempCoef[N_KEYS];
+    int16_t crosstalk[N_ANALOG_HWKKEYS][N_NEIGHBOURS]; // by hw id
+    uint8_t lut[N_ANALOG_HWKKEYS][LUT_N + 1];          // by hw id
+    uint32_t checksum;
+  };
+  uint8_t bytes[CAL_RECORD_SIZE];
+} CalRecord;
+
+static struct calStore {
+  int8_t nextRecord;   // first free record, -1 if the sector must be erased
+  uint32_t seq;
+  CalRecord saved;     // limits of the last record (in flash)
+  CalRecord next;      // record being saved (too big for the stack)
+  Timer timer;
+  volatile bool saveRequested;
+} calStore;
+
+static uint32_t calStore__checksum(const CalRecord *rec)
+{
+  const uint8_t *p = rec->bytes;
+  uint32_t sum = 0;
+  for (int i = 0; i < offsetof(CalRecord, checksum); i++) {
+    sum = (sum << 1 | sum >> 31) ^ p[i];
+  }
+  return sum;
+}
+
+static const CalRecord *calStore__record(int i)
+{
+  return (const CalRecord *)(XIP_BASE + CAL_STORE_OFFSET + i * CAL_RECORD_SIZE);
+}
+
+// finds the last valid record and the first free one
+static const CalRecord *calStore__find()
+{
+  const CalRecord *last = NULL;
+  calStore.nextRecord = -1;
+  for (int i = 0; i < CAL_STORE_N_RECORDS; i++) {
+    const CalRecord *rec = calStore__record(i);
+    if (rec->magic == 0xffffffffu) {
+      calStore.nextRecord = i;
+      break;
+    }
+    if (rec->magic == CAL_STORE_MAGIC && rec->checksum == calStore__checksum(rec)) {
+      last = rec;
+    }
+  }
+  return last;
+}
+
+// gives the stored limits to AnalogKeys; must be called after the keys are added
+void calStore_restore(uint8_t hw_version)
+{
+  memset(&calStore.saved, 0, sizeof(calStore.saved));
+  const CalRecord *rec = calStore__find();
+  if (rec != NULL && rec->hw_version == hw_version) {
+    calStore.saved = *rec;
+    for (uint8_t keyId = 0; keyId < N_KEYS; keyId++) {
+      analogKeys_setLimits(keyId, rec->minRaw[keyId], rec->maxRaw[keyId]);
+      analogKeys_setTempCoef(keyId, rec->tempCoef[keyId]);
+    }
+    for (uint8_t hwId = 0; hwId < N_ANALOG_HWKKEYS; hwId++) {
+      for (int k = 0; k < N_NEIGHBOURS; k++) {
+        analogKeys_setCrosstalk(hwId, k, rec->crosstalk[hwId][k]);
+      }
+      analogKeys_setLut(hwId, rec->lut[hwId]);
+    }
+  }
+  calStore.seq = rec != NULL ? rec->seq + 1 : 0;
+  timer_enable_ms(&calStore.timer, CAL_SAVE_INTERVAL_MS);
+}
+
+// set by a command; the save is done by calStore_task
+void calStore_requestSave()
+{
+  calStore.saveRequested = true;
+}
+
+// copies the limits of the calibrated keys; returns true if some changed
+static bool calStore__snapshot(CalRecord *rec)
+{
+  bool changed = false;
+  for (uint8_t hwId = 0; hwId < N_ANALOG_HWKKEYS; hwId++) {
+    for (int k = 0; k < N_NEIGHBOURS; k++) {
+      rec->crosstalk[hwId][k] = analogKeys_crosstalk(hwId, k);
+      if (rec->crosstalk[hwId][k] != calStore.saved.crosstalk[hwId][k]) changed = true;
+    }
+    for (int i = 0; i <= LUT_N; i++) {
+      rec->lut[hwId][i] = analogKeys_lutPoint(hwId, i);
+      if (rec->lut[hwId][i] != calStore.saved.lut[hwId][i]) changed = true;
+    }
+  }
+  for (uint8_t keyId = 0; keyId < N_KEYS; keyId++) {
+    int8_t slot = analogKeys_slot(keyId);
+    if (slot == -1) continue;
+    rec->tempCoef[keyId] = analogKeys.tempCoef[slot];
+    if (rec->tempCoef[keyId] != calStore.saved.tempCoef[keyId]) changed = true;
+    // limits are read from the other core; each one is a single 32 bit read
+    if (analogKeys.reciprocal[slot] == 0) continue;
+    rec->minRaw[keyId] = analogKeys.minRaw_S[slot] >> 13;
+    rec->maxRaw[keyId] = analogKeys.maxRaw_S[slot] >> 13;
+    if (abs(rec->minRaw[keyId] - calStore.saved.minRaw[keyId]) >= CAL_SAVE_MIN_CHANGE
+        || abs(rec->maxRaw[keyId] - calStore.saved.maxRaw[keyId]) >= CAL_SAVE_MIN_CHANGE) {
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static void calStore__write(const CalRecord *rec)
+{
+  if (SCAN_ON_CORE1) multicore_lockout_start_blocking();
+  uint32_t save = save_and_disable_interrupts();
+  if (calStore.nextRecord == -1) {
+    flash_range_erase(CAL_STORE_OFFSET, FLASH_SECTOR_SIZE);
+    calStore.nextRecord = 0;
+  }
+  flash_range_program(CAL_STORE_OFFSET + calStore.nextRecord * CAL_RECORD_SIZE,
+                      rec->bytes, CAL_RECORD_SIZE);
+  restore_interrupts(save);
+  if (SCAN_ON_CORE1) multicore_lockout_end_blocking();
+  calStore.nextRecord++;
+  if (calStore.nextRecord == CAL_STORE_N_RECORDS) calStore.nextRecord = -1;
+}
+
+// saves the limits if requested, or periodically if they changed;
+//   periodic saves are done only while idle, as they stop everything for a while
+void calStore_task(uint8_t hw_version, bool idle)
+{
+  bool requested = calStore.saveRequested;
+  if (!requested && !(idle && timer_elapsed(&calStore.timer))) return;
+  calStore.saveRequested = false;
+  timer_enable_ms(&calStore.timer, CAL_SAVE_INTERVAL_MS);
+  CalRecord *rec = &calStore.next;
+  *rec = calStore.saved;
+  if (!calStore__snapshot(rec) && !requested) return;
+  rec->magic = CAL_STORE_MAGIC;
+  rec->seq = calStore.seq++;
+  rec->hw_version = hw_version;
+  rec->checksum = calStore__checksum(rec);
+  calStore__write(rec);
+  calStore.saved = *rec;
+  log(LOG_I, "calibration saved (%u)", rec->seq);
+}
+
+// Debouncer {{{1
+// debounces all digital pins at once, with bitwise operations.
+// time is divided in ticks of DEBOUNCING_DELAY_MS/4; each pin has a 2 bit
+// counter of ticks, kept "vertically": bit 0 of all counters in cnt0, bit 1 in cnt1.
+// eager mode: a change of a pin is accepted at once, and the pin is locked
+//   (changes ignored) until its counter wraps after 4 ticks.
+// deferred mode: the counter of a pin counts ticks while the pin differs from
+//   its debounced state, and is reset when it does not; the change is accepted
+//   when the counter wraps after 4 ticks. Only the level of the pins at each
+//   tick is seen: a bounce that starts and ends between two ticks does not
+//   reset the counter.
+
+#define DEBOUNCE_TICK_US (DEBOUNCING_DELAY_MS * 1000 / 4)
+
+typedef struct {
+  bool eager;
+  uint32_t state;   // debounced state of the pins
+  uint32_t raw;     // last state read
+  uint32_t cnt0;
+  uint32_t cnt1;
+  uint32_t locked;  // eager mode: pins ignoring changes
+  uint32_t lastTick_µs;
+} Debouncer;
+
+void debouncer_init(Debouncer *self, bool eager, uint32_t state, uint32_t now_µs)
+{
+  self->eager = eager;
+  self->state = self->raw = state;
+  self->cnt0 = self->cnt1 = 0;
+  self->locked = 0;
+  self->lastTick_µs = now_µs;
+}
+
+// true while some pin needs more ticks (debouncer_update must be called periodically)
+bool debouncer_isBusy(Debouncer *self)
+{
+  return (self->cnt0 | self->cnt1 | self->locked | (self->raw ^ self->state)) != 0;
+}
+
+// increments the counters of the pins in mask; returns pins whose counter wrapped
+static uint32_t debouncer__tick(Debouncer *self, uint32_t mask)
+{
+  self->cnt1 = (self->cnt1 ^ self->cnt0) & mask;
+  self->cnt0 = ~self->cnt0 & mask;
+  return mask & ~(self->cnt0 | self->cnt1);
+}
+
+// receives the pins read at time now_µs; returns the pins whose debounced state changed
+uint32_t debouncer_update(Debouncer *self, uint32_t raw, uint32_t now_µs)
+{
+  uint32_t old_state = self->state;
+  if (!debouncer_isBusy(self)) {
+    self->lastTick_µs = now_µs;
+  }
+  // an edge captured before the last tick must not make the time wrap
+  if ((int32_t)(now_µs - self->lastTick_µs) < 0) now_µs = self->lastTick_µs;
+  // the ticks elapsed before this read saw the pins as they were read before
+  for (int n = 0; n < 4 && now_µs - self->lastTick_µs >= DEBOUNCE_TICK_US; n++) {
+    self->lastTick_µs += DEBOUNCE_TICK_US;
+    if (self->eager) {
+      self->locked &= ~debouncer__tick(self, self->locked);
+    } else {
+      self->state ^= debouncer__tick(self, self->raw ^ self->state);
+    }
+  }
+  self->raw = raw;
+  if (now_µs - self->lastTick_µs >= DEBOUNCE_TICK_US) {
+    // long time without updates
+    self->lastTick_µs = now_µs;
+  }
+  if (self->eager) {
+    uint32_t changed = (raw ^ self->state) & ~self->locked;
+    self->state ^= changed;
+    self->locked |= changed;
+    self->cnt0 &= ~changed;
+    self->cnt1 &= ~changed;
+  }
+  return self->state ^ old_state;
+}
+
+// DigitalScan {{{1
+// reads the digital keys in background.
+// an interrupt on each edge of the key pins captures the state of all pins,
+// with a timestamp, into a queue; LocalReader only processes these events.
+// single producer (interrupt), single consumer, on the same core.
+
+#define DIGQ_N 32 // must be a power of 2
+
+static struct {
+  uint32_t mask; // pins with keys
+  struct digq_event {
+    uint32_t pins;
+    uint32_t time_µs;
+  } data[DIGQ_N];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  uint32_t lastPins;
+  volatile bool overflow;
+} digitalScan;
+
+static void digitalScan__edge(uint gpio, uint32_t events)
+{
+  uint32_t pins = gpio_get_all() & digitalScan.mask;
+  if (pins == digitalScan.lastPins) return;
+  uint32_t head = digitalScan.head;
+  if (head - digitalScan.tail >= DIGQ_N) {
+    digitalScan.overflow = true;
+    return;
+  }
+  digitalScan.data[head % DIGQ_N] = (struct digq_event){ pins, time_us_32() };
+  digitalScan.head = head + 1;
+  digitalScan.lastPins = pins;
+}
+
+// interrupts are handled by the core that calls this
+void digitalScan_init(uint32_t mask)
+{
+  digitalScan.mask = mask;
+  digitalScan.head = digitalScan.tail = 0;
+  digitalScan.overflow = false;
+  // first event has the initial state
+  digitalScan.lastPins = ~gpio_get_all() & mask;
+  digitalScan__edge(0, 0);
+  for (uint pin = 0; pin < N_DIGITAL_HWKKEYS; pin++) {
+    if (mask & (1u << pin)) {
+      gpio_set_irq_enabled_with_callback(pin, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL,
+                                         true, digitalScan__edge);
+    }
+  }
+}
+
+uint32_t digitalScan_readPins()
+{
+  return gpio_get_all() & digitalScan.mask;
+}
+
+bool digitalScan_isEmpty()
+{
+  return digitalScan.tail == digitalScan.head && !digitalScan.overflow;
+}
+
+// gets the state of the pins after next edge; returns false if there is none
+bool digitalScan_nextEvent(uint32_t *pins, uint32_t *time_µs)
+{
+  uint32_t tail = digitalScan.tail;
+  if (tail == digitalScan.head) {
+    if (!digitalScan.overflow) return false;
+    // events were lost, resynchronize with current state
+    digitalScan.overflow = false;
+    *pins = digitalScan_readPins();
+    *time_µs = time_us_32();
+    return true;
+  }
+  *pins = digitalScan.data[tail % DIGQ_N].pins;
+  *time_µs = digitalScan.data[tail % DIGQ_N].time_µs;
+  digitalScan.tail = tail + 1;
+  return true;
+}
+
+// ScanScheduler {{{1
+// chooses the scan rate: maximum while keys are in use, IDLE_SCAN_HZ
+// after IDLE_DELAY_MS without key movement.
+// runs on the scanning core, so it uses its own time, not status.now
+
+typedef struct {
+  bool idle;
+  uint32_t lastMovement_µs;
+  uint32_t lastScan_µs;
+} ScanScheduler;
+
+void scanScheduler_init(ScanScheduler *self)
+{
+  self->idle = false;
+  self->lastMovement_µs = self->lastScan_µs = time_us_32();
+}
+
+// must be called after each scan, telling if some key moved
+void scanScheduler_scanned(ScanScheduler *self, bool moved)
+{
+  uint32_t now = time_us_32();
+  if (moved) {
+    self->lastMovement_µs = now;
+    self->idle = false;
+  } else if (!self->idle && now - self->lastMovement_µs > IDLE_DELAY_MS * 1000) {
+    self->idle = true;
+  }
+}
+
+bool scanScheduler_isIdle(ScanScheduler *self)
+{
+  return self->idle;
+}
+
+// time until next scan should start
+uint32_t scanScheduler_timeToNextScan_µs(ScanScheduler *self)
+{
+  if (!self->idle) return 0;
+  uint32_t elapsed = time_us_32() - self->lastScan_µs;
+  uint32_t period = 1000000 / IDLE_SCAN_HZ;
+  return (elapsed < period) ? period - elapsed : 0;
+}
+
+void scanScheduler_scanStarted(ScanScheduler *self)
+{
+  self->lastScan_µs = time_us_32();
+}
+
+// LocalReader {{{1
+// reads the keys physically connected to local microcontroller
+typedef struct {
+  uint8_t *sel_pins;
+  keyboardSide side;
+  keyboardType kb_type;
+  int8_t hw_version;
+  int8_t *hwIdToKeyId;
+  volatile uint32_t scanCount;
+  ScanScheduler scheduler;
+  Debouncer debouncer;
+  uint32_t unpublishedPins; // pins with changes not yet given to their keys
+  uint32_t lastEventLatency_µs; // time from edge to processing of last digital event
+} LocalReader;
+
+void localReader__initAnalogGPIO(LocalReader *self)
+{
+  adc_init();
+  for (int i = 0; i < N_ANA_PINS; i++) {
+    adc_gpio_init(ana_pins[i]);
+  }
+  for (int i = 0; i < N_SEL_PINS; i++) {
+    uint pin = self->sel_pins[i];
+    gpio_init(pin);
+    gpio_set_dir(pin, GPIO_OUT);
+  }
+}
+
+void localReader__initDigitalGPIO(LocalReader *self)
+{
+  for (int pin = 0; pin < N_DIGITAL_HWKKEYS; pin++) {
+    if (self->hwIdToKeyId[pin] != -1) {
+      gpio_init(pin);
+      gpio_set_dir(pin, GPIO_IN);
+      gpio_pull_up(pin);
+    }
+  }
+}
+
+int v1, v2;
+static bool detect_resistor(uint8_t pin1, uint8_t pin2)
+{
+  // can only detect resistor connecting analog pins (26 to 29)
+  if (pin1 < 26 || pin1 > 29 || pin2 < 26 || pin2 > 29) return false;
+  uint8_t adc1 = pin1 - 26;
+  adc_init();
+  adc_gpio_init(pin1);
+  adc_select_input(adc1);
+  gpio_init(pin2);
+  gpio_set_dir(pin2, GPIO_OUT);
+  gpio_put(pin2, false);
+  sleep_us(500);
+  v1 = adc_read();
+  gpio_put(pin2, true);
+  sleep_us(500);
+  v2 = adc_read();
+  gpio_deinit(28);
+  return abs(v1 - v2) > 500;
+}
+static bool detect_connection(uint8_t pin1, uint8_t pin2)
+{
+  bool v1, v2;
+  gpio_init(pin1);
+  gpio_set_dir(pin1, GPIO_IN);
+  gpio_init(pin2);
+  gpio_set_dir(pin2, GPIO_OUT);
+  gpio_put(pin2, false);
+  sleep_us(10);
+  v1 = gpio_get(pin1);
+  gpio_put(pin2, true);
+  sleep_us(10);
+  v2 = gpio_get(pin1);
+  gpio_deinit(pin1);
+  gpio_deinit(pin2);
+  return !v1 && v2;
+}
+
+static uint8_t readKeyboardVersion()
+{
+  // hardware type 2 and 3 have digital choc keys
+  // they can be recognized because they have a resistor connecting analog pins.
+  // type 2 is a right half, and has a resistor connecting pins 28 and 29
+  // type 3 is a left half, and has a resistor connecting pins 28 and 26
+  if (detect_resistor(28, 29)) return 2;
+  if (detect_resistor(28, 26)) return 3;
+
+  // hardware type 0 and 1 have analog hall sensors
+  // on type 1, the right keyboard half, pin 2 is connected to pin 1;
+  // on type 0, the left half, pin 2 is connected to pin 3
+  if (detect_connection(1, 2)) return 1;
+  if (detect_connection(3, 2)) return 0;
+
+  return 255;
+}
+
+void localReader_discoverTypeSideAndVersion(LocalReader *self)
+{
+  self->hw_version = readKeyboardVersion();
+  switch (self->hw_version) {
+    case 0:
+      self->kb_type = analog;
+      self->side = leftSide;
+      self->sel_pins = left_sel_pins;
+      self->hwIdToKeyId = leftAnalogHwIdToSwId;
+      comm_init(1);
+      break;
+    case 1:
+      self->kb_type = analog;
+      self->side = rightSide;
+      self->sel_pins = right_sel_pins;
+      self->hwIdToKeyId = rightAnalogHwIdToSwId;
+      comm_init(1);
+      break;
+    case 2:
+      self->kb_type = digital;
+      self->side = rightSide;
+      self->sel_pins = NULL;
+      self->hwIdToKeyId = rightDigitalHwIdToSwId;
+      comm_init(0);
+      break;
+    case 3:
+      self->kb_type = digital;
+      self->side = leftSide;
+      self->sel_pins = NULL;
+      self->hwIdToKeyId = leftDigitalHwIdToSwId;
+      comm_init(0);
+      break;
+    default:
+      self->side = noSide;
+  }
+}
+
+void localReader_init(LocalReader *self, Controller *controller)
+{
+  // also on digital halves, so that no key has an analog slot there
+  analogKeys_init();
+  localReader_discoverTypeSideAndVersion(self);
+  if (self->side == noSide) return;
+  if (self->kb_type == analog) {
+    localReader__initAnalogGPIO(self);
+    for (int8_t hwId = 0; hwId < N_ANALOG_HWKKEYS; hwId++) {
+      int8_t keyId = self->hwIdToKeyId[hwId];
+      if (keyId != -1) {
+        analogKeys_addKey(hwId, keyId, 80);
+      }
+    }
+    analogKeys_linkNeighbours();
+    calStore_restore(self->hw_version);
+  } else {
+    localReader__initDigitalGPIO(self);
+  }
+}
+
+// must be called on the core that will read the keys (interrupts are handled there)
+void localReader_startScan(LocalReader *self)
+{
+  self->scanCount = 0;
+  scanScheduler_init(&self->scheduler);
+  if (self->kb_type == analog) {
+    analogScan_init(self->sel_pins);
+    analogScan_calibrateSettleTimes();
+    analogKeys_startCycleCounter();
+  } else {
+    uint32_t mask = 0;
+    for (int pin = 0; pin < N_DIGITAL_HWKKEYS; pin++) {
+      if (self->hwIdToKeyId[pin] != -1) mask |= 1u << pin;
+    }
+    // all keys start released; real state comes from the first event
+    debouncer_init(&self->debouncer, DEBOUNCE_EAGER, mask, time_us_32());
+    self->unpublishedPins = 0;
+    digitalScan_init(mask);
+  }
+}
+
+keyboardSide localReader_keyboardSide(LocalReader *self)
+{
+  return self->side;
+}
+
+// gives the debounced state of the pins in mask to their keys
+static void localReader__setDigitalPins(LocalReader *self, uint32_t mask)
+{
+  uint32_t pins = self->debouncer.state;
+  while (mask != 0) {
+    uint8_t pin = __builtin_ctz(mask);
+    uint32_t bit = 1u << pin;
+    mask &= ~bit;
+    Key *key = Key_keyWithId(self->hwIdToKeyId[pin]);
+    if (key == NULL) continue;
+    if (key_setNewDigitalRaw(key, (pins & bit) == 0)) {
+      self->unpublishedPins &= ~bit;
+    } else {
+      self->unpublishedPins |= bit;
+    }
+  }
+}
+
+// returns true if some pin changed
+bool localReader_readDigitalKeys(LocalReader *self)
+{
+  uint32_t pins, time_µs;
+  bool changed = false;
+  uint32_t changedPins = self->unpublishedPins;
+  while (digitalScan_nextEvent(&pins, &time_µs)) {
+    changedPins |= debouncer_update(&self->debouncer, pins, time_µs);
+    self->lastEventLatency_µs = time_us_32() - time_µs;
+    changed = true;
+  }
+  if (debouncer_isBusy(&self->debouncer)) {
+    // debouncer needs the pins at each tick
+    changedPins |= debouncer_update(&self->debouncer, digitalScan_readPins(), time_us_32());
+  }
+  localReader__setDigitalPins(self, changedPins);
+  scanScheduler_scanned(&self->scheduler, changed);
+  return changed;
+}
+
+bool localReader_readAnalogKeys(LocalReader *self)
+{
+  analogScan_calibrationTask();
+  if (analogScan_isStopped() && scanScheduler_timeToNextScan_µs(&self->scheduler) == 0) {
+    scanScheduler_scanStarted(&self->scheduler);
+    analogScan_startFrame();
+  }
+  uint16_t (*frame)[N_LINE_SAMPLES] = analogScan_frame();
+  if (frame == NULL) return false;
+  bool moved = analogKeys_processFrame(frame);
+  analogScan_releaseFrame();
+  scanScheduler_scanned(&self->scheduler, moved);
+  // stop after each frame while idle, so that the scheduler paces the frames
+  analogScan_setFreeRunning(!scanScheduler_isIdle(&self->scheduler));
+  return true;
+}
+
+void localReader_readKeys(LocalReader *self)
+{
+  bool scanned = false;
+  switch (self->kb_type) {
+    case analog:
+      scanned = localReader_readAnalogKeys(self);
+      break;
+    case digital:
+      scanned = localReader_readDigitalKeys(self);
+      break;
+  }
+  if (scanned) self->scanCount++;
+}
+
+// sleeps until there is something to scan (only when the core does nothing else)
+void localReader_waitNextScan(LocalReader *self)
+{
+  if (self->kb_type == digital) {
+    if (debouncer_isBusy(&self->debouncer) || self->unpublishedPins != 0) return;
+    // wait for an edge; with interrupts disabled, one that arrives
+    // after the test still wakes the core
+    uint32_t save = save_and_disable_interrupts();
+    if (digitalScan_isEmpty()) __wfi();
+    restore_interrupts(save);
+    return;
+  }
+  uint32_t wait = scanScheduler_timeToNextScan_µs(&self->scheduler);
+  if (wait > 0) {
+    sleep_us(wait);
+  } else if (!analogScan_isStopped()) {
+    // next line (or frame) will be signaled by an interrupt
+    uint32_t save = save_and_disable_interrupts();
+    if (analogScan_frame() == NULL) __wfi();
+    restore_interrupts(save);
+  }
+}
+
+// core1 {{{1
+// when SCAN_ON_CORE1, core1 only reads the keys
+
+static LocalReader *core1_localReader;
+
+void core1_main()
+{
+  // lets core0 stop this core while writing to flash
+  multicore_lockout_victim_init();
+  localReader_startScan(core1_localReader);
+  while (true) {
+    localReader_readKeys(core1_localReader);
+    localReader_waitNextScan(core1_localReader);
+  }
+}
+// console {{{1
+// commands received by the usb serial port, one per line:
+//   t                      shows the actuation and release points of the keys
+//   t <key> <act> <rel>    sets the actuation and release points of key id <key>
+//                            (0 to TRAVEL_MAX)
+//   q                      shows the quarantined keys
+//   q <key>                takes a key out of quarantine
+//   c                      shows the temperature coefficients of the local keys
+//   c <key> <coef>         sets the temperature coefficient of a local analog key
+//                            (raw units per degree, times 256; saved with SAVE_CAL)
+
+static char console_line[32];
+static uint8_t console_len;
+
+static void console__showTriggerPoints()
+{
+  for (int keyId = 0; keyId < N_KEYS; keyId++) {
+    printf("k%d:%d/%d%c", keyId, keyTrigger[keyId].actuation, keyTrigger[keyId].release,
+           keyId % 9 == 8 ? '\n' : ' ');
+  }
+}
+
+static void console__execute(char *line)
+{
+  int keyId, actuation, release, coef;
+  if (strcmp(line, "q") == 0) {
+    for (keyId = 0; keyId < N_KEYS; keyId++) {
+      Key *key = Key_keyWithId(keyId);
+      if (key_isQuarantined(key)) printf("k%d ", keyId);
+      if (analogKeys_isFaulty(keyId)) printf("k%d(sensor) ", keyId);
+    }
+    printf("\n");
+  } else if (sscanf(line, "q %d", &keyId) == 1) {
+    if (keyId < 0 || keyId >= N_KEYS) {
+      printf("invalid key\n");
+    } else {
+      key_setQuarantined(Key_keyWithId(keyId), false);
+      analogKeys_clearFault(keyId);
+      printf("k%d\n", keyId);
+    }
+  } else if (strcmp(line, "c") == 0) {
+    for (keyId = 0; keyId < N_KEYS; keyId++) {
+      if (analogKeys_slot(keyId) != -1) printf("k%d:%d ", keyId, analogKeys_tempCoef(keyId));
+    }
+    printf("\n");
+  } else if (sscanf(line, "c %d %d", &keyId, &coef) == 2) {
+    if (keyId < 0 || keyId >= N_KEYS || coef < INT16_MIN || coef > INT16_MAX
+        || !analogKeys_setTempCoef(keyId, coef)) {
+      printf("invalid temperature coefficient\n");
+    } else {
+      printf("k%d:%d\n", keyId, coef);
+    }
+  } else if (strcmp(line, "t") == 0) {
+    console__showTriggerPoints();
+  } else if (sscanf(line, "t %d %d %d", &keyId, &actuation, &release) == 3) {
+    if (keyId < 0 || keyId >= N_KEYS
+        || !key_setTriggerPoints(Key_keyWithId(keyId), actuation, release)) {
+      printf("invalid trigger points\n");
+    } else {
+      printf("k%d:%d/%d\n", keyId, actuation, release);
+    }
+  } else if (line[0] != '\0') {
+    printf("unknown command: %s\n", line);
+  }
+}
+
+void console_task()
+{
+  int c;
+  while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+    if (c == '\r' || c == '\n') {
+      console_line[console_len] = '\0';
+      console__execute(console_line);
+      console_len = 0;
+    } else if (console_len < sizeof(console_line) - 1) {
+      console_line[console_len++] = c;
+    }
+  }
+}
+// }}}
+// USB callbacks {{{1
+#if 0
+//--------------------------------------------------------------------+
+// Device callbacks
+//--------------------------------------------------------------------+
+
+// Invoked when cdc when line state changed e.g connected/disconnected
+void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
+{
+	(void)itf;
+	(void)rts;
+
+	if (dtr) {
+		tud_cdc_write_str("Connected\n");
+	}
+}
+
+// Invoked when device is mounted
+void tud_mount_cb(void)
+{
+}
+
+// Invoked when device is unmounted
+void tud_umount_cb(void)
+{
+}
+
+// Invoked when usb bus is suspended
+// remote_wakeup_en : if host allow us  to perform remote wakeup
+// Within 7ms, device must draw an average of current less than 2.5 mA from bus
+void tud_suspend_cb(bool remote_wakeup_en)
+{
+  (void) remote_wakeup_en;
 }
 
 // Invoked when usb bus is resumed
@@ -2696,10 +5583,14 @@ void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_
 }
 
 // main {{{1
-void log_keys(keyboardSide side, int version)
+void log_keys(LocalReader *reader)
 {
+  keyboardSide side = reader->side;
+  int version = reader->hw_version;
+  uint32_t scanCount = reader->scanCount;
   static Timer timer;
   static uint32_t ct = 0;
+  static uint32_t lastScanCount = 0;
 
   if ((log_level & LOG_L) != 0) {
     if (!timer_is_enabled(&timer)) {
@@ -2719,10 +5610,48 @@ void log_keys(keyboardSide side, int version)
       printf("%s ", status.mySide == leftSide ? "LEFT" : "RIGHT");
       printf("U:%c%c%c%c ", status.usbReady ? 'R' : 'r', status.usbActive ? 'A' : 'a', status.otherSideUsbReady ? 'R' : 'r', status.otherSideUsbActive ? 'A' : 'a');
       printf("C:%c ", status.commOK ? 'Y' : 'n');
-      printf("%uHz ", ct);
+      uint32_t txHigh, txOver, rxHigh, rxOver;
+      comm_bufferStats(&txHigh, &txOver, &rxHigh, &rxOver);
+      // comm buffers: high-water mark/overflows
+      printf("Tx:%u/%u Rx:%u/%u ", txHigh, txOver, rxHigh, rxOver);
+      uint32_t baud;
+      int errorsPerSec, framesPerSec;
+      comm_linkStats(&baud, &errorsPerSec, &framesPerSec);
+      // link rate and errors/frames received in the last second
+      printf("B:%u E:%d/%d ", baud, errorsPerSec, framesPerSec);
+      int32_t offset_µs;
+      uint32_t delay_µs;
+      comm_clockStats(&offset_µs, &delay_µs);
+      // clock offset of the other half and round trip of its measurement
+      printf("Clk:%d/%uus ", offset_µs, delay_µs);
+      uint32_t retransmitted, dropped;
+      comm_retransmitStats(&retransmitted, &dropped);
+      // keys records retransmitted/dropped
+      printf("Rt:%u/%u ", retransmitted, dropped);
+      printf("%uHz ", scanCount - lastScanCount);
+      printf("M%uHz ", ct);
+      printf("S:%c ", scanScheduler_isIdle(&reader->scheduler) ? 'I' : 'A');
       printf("V%d ", version);
       printf("L%d ", controller_singleton->currentLayer);
+      if (EARLY_PRESS) {
+        // early presses (confirmed/false) and mean time gained
+        uint32_t n = earlyPressStats.count;
+        printf("EP:%u/%u %uus ", n, earlyPressStats.falseCount,
+               n == 0 ? 0 : earlyPressStats.leadSum_µs / n);
+      }
+      if (version == 0 || version == 1) {
+        printf("St:");
+        for (int sel = 0; sel < N_SEL_PINS; sel++) {
+          printf("%u%c", analogScan_settleTime_µs(sel), sel < N_SEL_PINS - 1 ? ',' : ' ');
+        }
+        printf("Cy:%u ", analogKeys_frameCycles());
+        // duration of full and reduced (idle) frames
+        printf("Fr:%u/%uus ", analogScan_frame_µs(false), analogScan_frame_µs(true));
+        int16_t cC = analogKeys_temperature_cC();
+        printf("T:%d.%02dC ", cC / 100, abs(cC % 100));
+      }
       if (version == 2 || version ==  3) {
+        printf("Lat:%uus ", reader->lastEventLatency_µs);
         printf("%d|%d\n", v1, v2);
         for (int i = firstKeyId; i <= lastKeyId; i++) {
           printf("%5u", keys[i].rawDigitalValue);
@@ -2730,19 +5659,34 @@ void log_keys(keyboardSide side, int version)
       } else if (version == 0 || version == 1) {
         printf("\n");
         for (int i = firstKeyId; i <= lastKeyId; i++) {
-          printf("%5u", keys[i].minRaw_S >> 13);
+          int s = analogKeys_slot(i);
+          printf("%5u", s == -1 ? 0 : analogKeys.minRaw_S[s] >> 13);
+        }
+        printf("\n");
+        for (int i = firstKeyId; i <= lastKeyId; i++) {
+          int s = analogKeys_slot(i);
+          printf("%5u", s == -1 ? 0 : analogKeys.maxRaw_S[s] >> 13);
+        }
+        printf("\n");
+        for (int i = firstKeyId; i <= lastKeyId; i++) {
+          int s = analogKeys_slot(i);
+          printf("%5u", s == -1 ? 0 : (analogKeys.maxRaw_S[s] - analogKeys.minRaw_S[s]) >> 13);
         }
         printf("\n");
         for (int i = firstKeyId; i <= lastKeyId; i++) {
-          printf("%5u", keys[i].maxRaw_S >> 13);
+          int s = analogKeys_slot(i);
+          printf("%5u", s == -1 ? 0 : analogKeys.raw[s]);
         }
         printf("\n");
+        // noise at rest (tenths of raw units) and resulting hysteresis (tenths of steps)
         for (int i = firstKeyId; i <= lastKeyId; i++) {
-          printf("%5u", (keys[i].maxRaw_S - keys[i].minRaw_S) >> 13);
+          int s = analogKeys_slot(i);
+          printf("%5u", s == -1 ? 0 : analogKeys_noise10(s));
         }
         printf("\n");
         for (int i = firstKeyId; i <= lastKeyId; i++) {
-          printf("%5u", keys[i].rawAnalogValue);
+          int s = analogKeys_slot(i);
+          printf("%5u", s == -1 ? 0 : analogKeys.hysteresis10[s]);
         }
       }
       printf("\n");
@@ -2752,6 +5696,7 @@ void log_keys(keyboardSide side, int version)
       printf("\n");
       fflush(stdout);
       ct = 0;
+      lastScanCount = scanCount;
     }
   }
 }
@@ -2824,19 +5769,36 @@ int main()
   status.mySide = localReader_keyboardSide(&localReader);
   if (status.mySide == noSide) fatal("Cannot determine keyboard side");
   status.otherSide = (status.mySide == leftSide) ? rightSide : leftSide;
+  comm_initLink();
 
   setUsbSide(noSide);
 
+  if (SCAN_ON_CORE1) {
+    core1_localReader = &localReader;
+    multicore_launch_core1(core1_main);
+  } else {
+    localReader_startScan(&localReader);
+  }
+
   while (true) {
     update_now();
     comm_task();
-    localReader_readKeys(&localReader);
+    if (SCAN_ON_CORE1) {
+      Key_processScannedVals();
+    } else {
+      localReader_readKeys(&localReader);
+    }
     if (status.usbActive) {
       controller_task(&controller);
     } else if (status.otherSideUsbActive) {
       Key_sendChangedKeys(status.mySide);
     }
-    log_keys(status.mySide, localReader.hw_version);
+    if (localReader.kb_type == analog) {
+      calStore_task(localReader.hw_version, scanScheduler_isIdle(&localReader.scheduler));
+      analogKeys_reportTask();
+    }
+    log_keys(&localReader);
+    console_task();
     usb_task(&usb);
     synchronizeAndDecideUsbSide();
   }